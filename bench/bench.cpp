@@ -0,0 +1,415 @@
+#include "../src/base64.hpp"
+#include "../src/extism.hpp"
+#include "../src/sha256.hpp"
+
+#include <cstring>
+#include <fstream>
+
+#include <benchmark/benchmark.h>
+
+std::vector<uint8_t> read(const char *filename) {
+  std::ifstream file(filename, std::ios::binary);
+  return std::vector<uint8_t>((std::istreambuf_iterator<char>(file)),
+                              std::istreambuf_iterator<char>());
+}
+
+const std::string code = "../wasm/code.wasm";
+
+namespace {
+using namespace extism;
+
+void PluginNew(benchmark::State &state) {
+  auto wasm = read(code.c_str());
+  for (auto _ : state) {
+    Plugin plugin(wasm);
+    benchmark::DoNotOptimize(plugin.get());
+  }
+}
+BENCHMARK(PluginNew);
+
+void PluginNewFromPath(benchmark::State &state) {
+  auto manifest = Manifest::wasmPath(code);
+  for (auto _ : state) {
+    Plugin plugin(manifest);
+    benchmark::DoNotOptimize(plugin.get());
+  }
+}
+BENCHMARK(PluginNewFromPath);
+
+// A self-contained manifest embeds the module as base64
+void PluginNewFromBytesManifest(benchmark::State &state) {
+  auto manifest = Manifest::wasmBytes(read(code.c_str()), "");
+  for (auto _ : state) {
+    Plugin plugin(manifest);
+    benchmark::DoNotOptimize(plugin.get());
+  }
+}
+BENCHMARK(PluginNewFromBytesManifest);
+
+// The mapped module is passed by pointer without being read or copied
+void PluginNewFromMappedFile(benchmark::State &state) {
+  Manifest manifest({Wasm::mmap(code)});
+  for (auto _ : state) {
+    Plugin plugin(manifest);
+    benchmark::DoNotOptimize(plugin.get());
+  }
+}
+BENCHMARK(PluginNewFromMappedFile);
+
+void CompiledPluginInstantiate(benchmark::State &state) {
+  CompiledPlugin compiled(read(code.c_str()));
+  for (auto _ : state) {
+    Plugin plugin = compiled.instantiate();
+    benchmark::DoNotOptimize(plugin.get());
+  }
+}
+BENCHMARK(CompiledPluginInstantiate);
+
+void CallCopy(benchmark::State &state) {
+  Plugin plugin(read(code.c_str()));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(plugin.call("count_vowels", "aaa").vector());
+  }
+}
+BENCHMARK(CallCopy);
+
+void CallOwned(benchmark::State &state) {
+  Plugin plugin(read(code.c_str()));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(plugin.callOwned("count_vowels", "aaa"));
+  }
+}
+BENCHMARK(CallOwned);
+
+// Fuel metering overhead, range(0) is the fuel limit or 0 for no limit
+void CallFuel(benchmark::State &state) {
+  std::optional<uint64_t> fuel;
+  if (state.range(0) > 0) {
+    fuel = state.range(0);
+  }
+  Plugin plugin(read(code.c_str()), false, {}, fuel);
+  std::string input(64 << 10, 'a');
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(plugin.call("count_vowels", input));
+  }
+  state.SetBytesProcessed(state.iterations() * input.size());
+}
+BENCHMARK(CallFuel)->Arg(0)->Arg(int64_t(1) << 40);
+
+// Runs loop.wasm until it has used range(0) fuel, the time per iteration is
+// the cost of that many metered instructions
+void LoopFuel(benchmark::State &state) {
+  Plugin plugin(read("../wasm/loop.wasm"), false, {}, state.range(0));
+  for (auto _ : state) {
+    try {
+      plugin.call("loop_forever");
+    } catch (const FuelExhausted &) {
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(LoopFuel)->Arg(1 << 20)->Arg(1 << 24);
+
+void CallInputSize(benchmark::State &state) {
+  Plugin plugin(read(code.c_str()));
+  std::string input(state.range(0), 'a');
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(plugin.call("count_vowels", input));
+  }
+  state.SetBytesProcessed(state.iterations() * input.size());
+}
+BENCHMARK(CallInputSize)
+    ->Arg(0)
+    ->RangeMultiplier(16)
+    ->Range(16, 16 << 20);
+
+std::vector<std::string> records(size_t n) {
+  std::vector<std::string> records;
+  for (size_t i = 0; i < n; i++) {
+    records.push_back("record " + std::to_string(i) + " with some vowels");
+  }
+  return records;
+}
+
+void CallLoop(benchmark::State &state) {
+  Plugin plugin(read(code.c_str()));
+  auto inputs = records(state.range(0));
+  for (auto _ : state) {
+    std::vector<std::vector<uint8_t>> outputs;
+    for (const auto &input : inputs) {
+      outputs.push_back(plugin.call("count_vowels", input).vector());
+    }
+    benchmark::DoNotOptimize(outputs);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(CallLoop)->Arg(1000);
+
+void CallBatch(benchmark::State &state) {
+  Plugin plugin(read(code.c_str()));
+  auto strings = records(state.range(0));
+  std::vector<std::string_view> inputs(strings.begin(), strings.end());
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(plugin.callBatch("count_vowels", inputs));
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(CallBatch)->Arg(1000);
+
+Config tenantConfig() {
+  Config config;
+  for (int i = 0; i < 32; i++) {
+    config["key" + std::to_string(i)] = "a somewhat longer value " +
+                                        std::to_string(i);
+  }
+  return config;
+}
+
+void PluginConfig(benchmark::State &state) {
+  Plugin plugin(read(code.c_str()));
+  const Config config = tenantConfig();
+  for (auto _ : state) {
+    plugin.config(config);
+  }
+}
+BENCHMARK(PluginConfig);
+
+void ConfigFanOut(benchmark::State &state) {
+  CompiledPlugin compiled(read(code.c_str()));
+  std::vector<Plugin> plugins;
+  for (int i = 0; i < 500; i++) {
+    plugins.push_back(compiled.instantiate());
+  }
+  const Config config = tenantConfig();
+  for (auto _ : state) {
+    for (auto &plugin : plugins) {
+      plugin.config(config);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * plugins.size());
+}
+BENCHMARK(ConfigFanOut);
+
+void ConfigBlobFanOut(benchmark::State &state) {
+  CompiledPlugin compiled(read(code.c_str()));
+  std::vector<Plugin> plugins;
+  for (int i = 0; i < 500; i++) {
+    plugins.push_back(compiled.instantiate());
+  }
+  const Config config = tenantConfig();
+  for (auto _ : state) {
+    ConfigBlob blob(config);
+    for (auto &plugin : plugins) {
+      plugin.config(blob);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * plugins.size());
+}
+BENCHMARK(ConfigBlobFanOut);
+
+void SharedPluginCall(benchmark::State &state) {
+  static Plugin *plugin = nullptr;
+  if (state.thread_index() == 0) {
+    plugin = new Plugin(read(code.c_str()));
+  }
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(plugin->call("count_vowels", "this is a test"));
+  }
+  if (state.thread_index() == 0) {
+    delete plugin;
+  }
+}
+BENCHMARK(SharedPluginCall)
+    ->ThreadRange(1, benchmark::CPUInfo::Get().num_cpus)
+    ->UseRealTime();
+
+void PluginPoolCall(benchmark::State &state) {
+  static PluginPool *pool = nullptr;
+  if (state.thread_index() == 0) {
+    pool = new PluginPool(Manifest::wasmPath(code));
+  }
+  for (auto _ : state) {
+    auto plugin = pool->acquire();
+    benchmark::DoNotOptimize(plugin.call("count_vowels", "this is a test"));
+  }
+  if (state.thread_index() == 0) {
+    delete pool;
+  }
+}
+BENCHMARK(PluginPoolCall)
+    ->ThreadRange(1, benchmark::CPUInfo::Get().num_cpus)
+    ->UseRealTime();
+
+void PluginPoolCallAsync(benchmark::State &state) {
+  PluginPool pool(Manifest::wasmPath(code));
+  std::vector<CallFuture> futures;
+  for (auto _ : state) {
+    for (int64_t i = 0; i < state.range(0); i++) {
+      futures.push_back(pool.callAsync("count_vowels", "this is a test"));
+    }
+    for (auto &f : futures) {
+      benchmark::DoNotOptimize(f.get());
+    }
+    futures.clear();
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(PluginPoolCallAsync)->Arg(1)->Arg(64)->Arg(1024)->UseRealTime();
+
+// Three count_vowels stages, each counting the output of the one before
+void PipelineCall(benchmark::State &state) {
+  Plugin first(Manifest::wasmPath(code));
+  PluginPool middle(Manifest::wasmPath(code));
+  Plugin last(Manifest::wasmPath(code));
+  auto pipeline = Pipeline::Builder()
+                      .stage(first, "count_vowels")
+                      .stage(middle, "count_vowels")
+                      .stage(last, "count_vowels")
+                      .build();
+  std::vector<CallFuture> futures;
+  for (auto _ : state) {
+    for (int64_t i = 0; i < state.range(0); i++) {
+      futures.push_back(pipeline.submit("this is a test"));
+    }
+    for (auto &f : futures) {
+      benchmark::DoNotOptimize(f.get());
+    }
+    futures.clear();
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(PipelineCall)->Arg(1)->Arg(64)->UseRealTime();
+
+const std::string codeFunctions = "../wasm/code-functions.wasm";
+
+void HostFunctionCall(benchmark::State &state) {
+  auto t = std::vector<ValType>{ValType::ExtismValType_I64};
+  Function hello_world("hello_world", t, t,
+                       [](CurrentPlugin plugin, void *user_data) {
+                         plugin.output(plugin.inputStringView());
+                       });
+  Plugin plugin(read(codeFunctions.c_str()), true, {hello_world});
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(plugin.call("count_vowels", "aaa"));
+  }
+}
+BENCHMARK(HostFunctionCall);
+
+void TypedHostFunctionCall(benchmark::State &state) {
+  auto hello_world = Function::make(
+      "hello_world", [](std::string_view input) { return input; });
+  Plugin plugin(read(codeFunctions.c_str()), true, {hello_world});
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(plugin.call("count_vowels", "aaa"));
+  }
+}
+BENCHMARK(TypedHostFunctionCall);
+
+// A host function returning 1 MiB, copied from a host buffer
+void HostFunctionOutputCopy(benchmark::State &state) {
+  auto t = std::vector<ValType>{ValType::ExtismValType_I64};
+  Function hello_world("hello_world", t, t,
+                       [](CurrentPlugin plugin, void *user_data) {
+                         std::vector<uint8_t> row(1 << 20, 'x');
+                         plugin.output(row.data(), row.size());
+                       });
+  Plugin plugin(read(codeFunctions.c_str()), true, {hello_world});
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(plugin.call("count_vowels", "aaa"));
+  }
+  state.SetBytesProcessed(state.iterations() * (1 << 20));
+}
+BENCHMARK(HostFunctionOutputCopy);
+
+// A host function returning 1 MiB, written directly into plugin memory
+void HostFunctionOutputWriter(benchmark::State &state) {
+  auto t = std::vector<ValType>{ValType::ExtismValType_I64};
+  Function hello_world("hello_world", t, t,
+                       [](CurrentPlugin plugin, void *user_data) {
+                         OutputWriter out(plugin, 1 << 20);
+                         memset(out.prepare(1 << 20), 'x', 1 << 20);
+                         out.commit();
+                       });
+  Plugin plugin(read(codeFunctions.c_str()), true, {hello_world});
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(plugin.call("count_vowels", "aaa"));
+  }
+  state.SetBytesProcessed(state.iterations() * (1 << 20));
+}
+BENCHMARK(HostFunctionOutputWriter);
+
+void ManifestJson(benchmark::State &state) {
+  auto manifest = Manifest::wasmBytes(read(code.c_str()), "");
+  for (int i = 0; i < 16; i++) {
+    manifest.setConfig("key" + std::to_string(i), "value");
+  }
+  manifest.allowHost("example.com");
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(manifest.json(state.range(0)));
+  }
+}
+BENCHMARK(ManifestJson)->Arg(0)->Arg(1);
+
+void Base64Encode(benchmark::State &state) {
+  const auto encoder = base64_encoders()[state.range(0)];
+  std::vector<uint8_t> data(state.range(1));
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = static_cast<uint8_t>(i * 31);
+  }
+  std::string out(base64_encoded_length(data.size()), '\0');
+  state.SetLabel(encoder.first);
+  for (auto _ : state) {
+    encoder.second(data.data(), data.size(), out.data());
+    benchmark::DoNotOptimize(out.data());
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(Base64Encode)->Apply([](benchmark::internal::Benchmark *b) {
+  for (size_t i = 0; i < base64_encoders().size(); i++) {
+    b->Args({static_cast<int64_t>(i), 4 << 10});
+    b->Args({static_cast<int64_t>(i), 4 << 20});
+  }
+});
+
+void Sha256(benchmark::State &state) {
+  const auto compressor = sha256_compressors()[state.range(0)];
+  std::vector<uint8_t> data(state.range(1));
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = static_cast<uint8_t>(i * 31);
+  }
+  uint8_t digest[sha256_length];
+  state.SetLabel(compressor.first);
+  for (auto _ : state) {
+    sha256(compressor.second, data.data(), data.size(), digest);
+    benchmark::DoNotOptimize(digest);
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(Sha256)->Apply([](benchmark::internal::Benchmark *b) {
+  for (size_t i = 0; i < sha256_compressors().size(); i++) {
+    b->Args({static_cast<int64_t>(i), 4 << 10});
+    b->Args({static_cast<int64_t>(i), 4 << 20});
+  }
+});
+
+// Hashing the modules of a manifest in parallel, none of them remembered
+void ManifestComputeHashes(benchmark::State &state) {
+  std::vector<uint8_t> data(4 << 20);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = static_cast<uint8_t>(i * 31);
+  }
+  for (auto _ : state) {
+    Manifest manifest;
+    for (int64_t i = 0; i < state.range(0); i++) {
+      manifest.addWasm(Wasm(
+          WasmBytes::CreateWithoutOwnership(data.data(), data.size())));
+    }
+    manifest.computeHashes();
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0) * data.size());
+}
+BENCHMARK(ManifestComputeHashes)->Arg(1)->Arg(8)->UseRealTime();
+
+}; // namespace
+
+BENCHMARK_MAIN();
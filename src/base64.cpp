@@ -0,0 +1,190 @@
+#include "base64.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define EXTISM_BASE64_X86
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define EXTISM_BASE64_NEON
+#include <arm_neon.h>
+#endif
+
+namespace extism {
+
+static const char alpha[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                            "abcdefghijklmnopqrstuvwxyz"
+                            "0123456789+/";
+
+void base64_encode_scalar(const uint8_t *data, size_t len, char *out) {
+  char *out_cursor = out;
+  while (len > 0) {
+    const size_t to_encode = std::min<size_t>(3, len);
+    len -= to_encode;
+    uint8_t c[4];
+    c[1] = c[2] = 0;
+    memcpy(c, data, to_encode);
+    data += to_encode;
+    const uint32_t u =
+        (uint32_t)c[0] << 16 | (uint32_t)c[1] << 8 | (uint32_t)c[2];
+    *out_cursor++ = alpha[u >> 18];
+    *out_cursor++ = alpha[u >> 12 & 63];
+    *out_cursor++ = to_encode < 2 ? '=' : alpha[u >> 6 & 63];
+    *out_cursor++ = to_encode < 3 ? '=' : alpha[u & 63];
+  }
+}
+
+// The vector encoders below follow Wojciech Muła's and Daniel Lemire's
+// "Faster Base64 Encoding and Decoding using AVX2 Instructions": bytes are
+// shuffled so each 32-bit lane holds 3 input bytes, split into four 6-bit
+// indices with multiplies, then mapped to ASCII by adding a per-range offset
+// looked up with a byte shuffle. Whatever doesn't fill a full block is left
+// to the scalar encoder.
+
+#ifdef EXTISM_BASE64_X86
+__attribute__((target("ssse3"))) static inline __m128i
+base64_indices_ssse3(__m128i in) {
+  in = _mm_shuffle_epi8(
+      in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+  const __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+  const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+  const __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+  const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+  return _mm_or_si128(t1, t3);
+}
+
+__attribute__((target("ssse3"))) static inline __m128i
+base64_ascii_ssse3(__m128i indices) {
+  const __m128i offsets =
+      _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                    '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  // 0 for A-Z, 13 for a-z, 1..11 for 0-9, 12 for '/', 11 for '+'
+  __m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+  const __m128i upper = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+  range = _mm_or_si128(range, _mm_and_si128(upper, _mm_set1_epi8(13)));
+  return _mm_add_epi8(_mm_shuffle_epi8(offsets, range), indices);
+}
+
+__attribute__((target("ssse3"))) static void
+base64_encode_ssse3(const uint8_t *data, size_t len, char *out) {
+  // Each block encodes 12 bytes, but loads 16
+  while (len >= 16) {
+    const __m128i in =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out),
+                     base64_ascii_ssse3(base64_indices_ssse3(in)));
+    data += 12;
+    len -= 12;
+    out += 16;
+  }
+  base64_encode_scalar(data, len, out);
+}
+
+__attribute__((target("avx2"))) static void
+base64_encode_avx2(const uint8_t *data, size_t len, char *out) {
+  const __m256i shuffle = _mm256_setr_epi8(
+      1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10, 1, 0, 2, 1, 4, 3, 5,
+      4, 7, 6, 8, 7, 10, 9, 11, 10);
+  const __m256i offsets = _mm256_setr_epi8(
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  // Each block encodes 24 bytes, but loads 28
+  while (len >= 28) {
+    const __m128i lo =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+    const __m128i hi =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 12));
+    __m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+    in = _mm256_shuffle_epi8(in, shuffle);
+    const __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+    const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    const __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+    const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+    const __m256i indices = _mm256_or_si256(t1, t3);
+
+    __m256i range = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+    const __m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+    range =
+        _mm256_or_si256(range, _mm256_and_si256(upper, _mm256_set1_epi8(13)));
+    _mm256_storeu_si256(
+        reinterpret_cast<__m256i *>(out),
+        _mm256_add_epi8(_mm256_shuffle_epi8(offsets, range), indices));
+    data += 24;
+    len -= 24;
+    out += 32;
+  }
+  base64_encode_ssse3(data, len, out);
+}
+#endif
+
+#ifdef EXTISM_BASE64_NEON
+static void base64_encode_neon(const uint8_t *data, size_t len, char *out) {
+  const uint8_t *table = reinterpret_cast<const uint8_t *>(alpha);
+  uint8x16x4_t lookup;
+  lookup.val[0] = vld1q_u8(table);
+  lookup.val[1] = vld1q_u8(table + 16);
+  lookup.val[2] = vld1q_u8(table + 32);
+  lookup.val[3] = vld1q_u8(table + 48);
+  // NEON can deinterleave and interleave directly, so there is no need for
+  // the shuffles used on x86: each block encodes 48 bytes
+  while (len >= 48) {
+    const uint8x16x3_t in = vld3q_u8(data);
+    uint8x16x4_t indices;
+    indices.val[0] = vshrq_n_u8(in.val[0], 2);
+    indices.val[1] =
+        vorrq_u8(vshrq_n_u8(in.val[1], 4),
+                 vandq_u8(vshlq_n_u8(in.val[0], 4), vdupq_n_u8(0x30)));
+    indices.val[2] =
+        vorrq_u8(vshrq_n_u8(in.val[2], 6),
+                 vandq_u8(vshlq_n_u8(in.val[1], 2), vdupq_n_u8(0x3c)));
+    indices.val[3] = vandq_u8(in.val[2], vdupq_n_u8(0x3f));
+
+    uint8x16x4_t ascii;
+    ascii.val[0] = vqtbl4q_u8(lookup, indices.val[0]);
+    ascii.val[1] = vqtbl4q_u8(lookup, indices.val[1]);
+    ascii.val[2] = vqtbl4q_u8(lookup, indices.val[2]);
+    ascii.val[3] = vqtbl4q_u8(lookup, indices.val[3]);
+    vst4q_u8(reinterpret_cast<uint8_t *>(out), ascii);
+    data += 48;
+    len -= 48;
+    out += 64;
+  }
+  base64_encode_scalar(data, len, out);
+}
+#endif
+
+// Every encoder supported by the CPU, by name, starting with the scalar one
+std::vector<std::pair<const char *, Base64Encoder>> base64_encoders() {
+  std::vector<std::pair<const char *, Base64Encoder>> encoders = {
+      {"scalar", base64_encode_scalar}};
+#ifdef EXTISM_BASE64_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("ssse3")) {
+    encoders.emplace_back("ssse3", base64_encode_ssse3);
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    encoders.emplace_back("avx2", base64_encode_avx2);
+  }
+#endif
+#ifdef EXTISM_BASE64_NEON
+  encoders.emplace_back("neon", base64_encode_neon);
+#endif
+  return encoders;
+}
+
+void base64_encode(const uint8_t *data, size_t len, char *out) {
+  static const Base64Encoder encoder = base64_encoders().back().second;
+  encoder(data, len, out);
+}
+
+std::string base64_encode(const uint8_t *data, size_t len) {
+  std::string out(base64_encoded_length(len), '\0');
+  base64_encode(data, len, out.data());
+  return out;
+}
+
+}; // namespace extism
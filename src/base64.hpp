@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace extism {
+
+typedef void (*Base64Encoder)(const uint8_t *data, size_t len, char *out);
+
+// Length of the base64 encoding of `len` bytes, including padding
+inline size_t base64_encoded_length(size_t len) { return (len + 2) / 3 * 4; }
+
+// Encode `len` bytes into `out`, which must have room for
+// base64_encoded_length(len) characters. Uses the fastest encoder supported
+// by the CPU
+void base64_encode(const uint8_t *data, size_t len, char *out);
+
+// Encode `len` bytes as a string
+std::string base64_encode(const uint8_t *data, size_t len);
+
+// Portable byte-at-a-time encoder
+void base64_encode_scalar(const uint8_t *data, size_t len, char *out);
+
+// Every encoder supported by the CPU, by name, starting with the scalar one
+std::vector<std::pair<const char *, Base64Encoder>> base64_encoders();
+
+}; // namespace extism
@@ -0,0 +1,70 @@
+#include "extism.hpp"
+
+namespace extism {
+
+// Buffers kept per thread for reuse by OwnedBuffer
+static const size_t maxFreeBuffers = 8;
+// Larger buffers are freed rather than kept around
+static const size_t maxFreeCapacity = 16 * 1024 * 1024;
+
+namespace {
+struct FreeList {
+  std::vector<std::vector<uint8_t>> buffers;
+  // Reserved up front so returning a buffer never allocates
+  FreeList() { buffers.reserve(maxFreeBuffers); }
+  ~FreeList();
+};
+} // namespace
+
+static thread_local FreeList freeList;
+// Set once `freeList` has been destroyed during thread exit
+static thread_local bool freeListDestroyed = false;
+
+FreeList::~FreeList() { freeListDestroyed = true; }
+
+// Take the smallest free buffer that fits `length`, or the largest one
+static std::vector<uint8_t> takeStorage(size_t length) {
+  if (freeListDestroyed || freeList.buffers.empty()) {
+    return std::vector<uint8_t>();
+  }
+  auto &buffers = freeList.buffers;
+  size_t best = 0;
+  for (size_t i = 1; i < buffers.size(); i++) {
+    const size_t cap = buffers[i].capacity();
+    const size_t bestCap = buffers[best].capacity();
+    if (bestCap < length ? cap > bestCap : (cap >= length && cap < bestCap)) {
+      best = i;
+    }
+  }
+  std::vector<uint8_t> storage = std::move(buffers[best]);
+  buffers[best] = std::move(buffers.back());
+  buffers.pop_back();
+  return storage;
+}
+
+static void putStorage(std::vector<uint8_t> storage) {
+  if (freeListDestroyed || storage.capacity() == 0 ||
+      storage.capacity() > maxFreeCapacity ||
+      freeList.buffers.size() >= maxFreeBuffers) {
+    return;
+  }
+  storage.clear();
+  freeList.buffers.push_back(std::move(storage));
+}
+
+OwnedBuffer::OwnedBuffer(const uint8_t *data, size_t length)
+    : storage(takeStorage(length)) {
+  this->storage.assign(data, data + length);
+}
+
+OwnedBuffer &OwnedBuffer::operator=(OwnedBuffer &&b) noexcept {
+  if (this != &b) {
+    putStorage(std::move(this->storage));
+    this->storage = std::move(b.storage);
+  }
+  return *this;
+}
+
+OwnedBuffer::~OwnedBuffer() { putStorage(std::move(this->storage)); }
+
+}; // namespace extism
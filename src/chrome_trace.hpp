@@ -0,0 +1,126 @@
+#pragma once
+
+#include "extism.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <ostream>
+#include <thread>
+
+namespace extism {
+
+// A Tracer that keeps spans as Chrome trace events, for viewing in
+// chrome://tracing or https://ui.perfetto.dev:
+//   ChromeTracer tracer;
+//   Tracer::set(&tracer);
+//   ...
+//   Tracer::set(nullptr);
+//   std::ofstream out("trace.json");
+//   tracer.write(out);
+class ChromeTracer : public Tracer {
+  struct Event {
+    char phase;
+    Span::Kind kind;
+    std::string name;
+    double timestamp;
+    size_t thread;
+    uint64_t inputBytes;
+    uint64_t outputBytes;
+    const void *context;
+    bool error;
+  };
+
+  const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  mutable std::mutex mutex;
+  std::vector<Event> events;
+
+  void record(char phase, const Span &span) {
+    const std::chrono::duration<double, std::micro> elapsed =
+        std::chrono::steady_clock::now() - start;
+    Event event{phase,
+                span.kind,
+                std::string(span.name),
+                elapsed.count(),
+                std::hash<std::thread::id>()(std::this_thread::get_id()),
+                span.inputBytes,
+                span.outputBytes,
+                span.context,
+                span.error};
+    std::lock_guard<std::mutex> lock(mutex);
+    events.push_back(std::move(event));
+  }
+
+  static const char *category(Span::Kind kind) {
+    switch (kind) {
+    case Span::Kind::Call:
+      return "call";
+    case Span::Kind::HostFunction:
+      return "host_function";
+    case Span::Kind::Reset:
+      return "reset";
+    case Span::Kind::Create:
+      return "create";
+    }
+    return "";
+  }
+
+  static void writeString(std::ostream &out, std::string_view s) {
+    out << '"';
+    for (unsigned char c : s) {
+      if (c == '"' || c == '\\') {
+        out << '\\' << c;
+      } else if (c < 0x20) {
+        char escaped[8];
+        snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+        out << escaped;
+      } else {
+        out << c;
+      }
+    }
+    out << '"';
+  }
+
+public:
+  void begin(const Span &span) override { record('B', span); }
+  void end(const Span &span) override { record('E', span); }
+
+  // Write the events recorded so far as a JSON trace
+  void write(std::ostream &out) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    out << "{\"traceEvents\":[";
+    for (size_t i = 0; i < events.size(); i++) {
+      const auto &e = events[i];
+      if (i > 0) {
+        out << ',';
+      }
+      out << "{\"name\":";
+      writeString(out, e.name.empty() ? category(e.kind) : e.name);
+      char timestamp[32];
+      snprintf(timestamp, sizeof(timestamp), "%.3f", e.timestamp);
+      out << ",\"cat\":\"" << category(e.kind) << "\",\"ph\":\"" << e.phase
+          << "\",\"ts\":" << timestamp << ",\"pid\":1,\"tid\":" << e.thread
+          << ",\"args\":{\"input_bytes\":" << e.inputBytes;
+      if (e.phase == 'E') {
+        out << ",\"output_bytes\":" << e.outputBytes
+            << ",\"error\":" << (e.error ? "true" : "false");
+      }
+      if (e.context != nullptr) {
+        char context[32];
+        snprintf(context, sizeof(context), "%p", e.context);
+        out << ",\"context\":\"" << context << '"';
+      }
+      out << "}}";
+    }
+    out << "]}\n";
+  }
+
+  // Drop the events recorded so far
+  void clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    events.clear();
+  }
+};
+
+}; // namespace extism
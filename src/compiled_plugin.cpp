@@ -0,0 +1,56 @@
+#include "extism.hpp"
+
+namespace extism {
+
+CompiledPlugin::CompiledPlugin(const uint8_t *wasm, size_t length,
+                               bool withWasi, std::vector<Function> functions)
+    : functions(std::make_shared<const std::vector<Function>>(
+          std::move(functions))) {
+  std::vector<const ExtismFunction *> ptrs;
+  for (const auto &i : *this->functions) {
+    ptrs.push_back(i.get());
+  }
+
+  char *errmsg = nullptr;
+  auto ptr = extism_compiled_plugin_new(wasm, length, ptrs.data(), ptrs.size(),
+                                        withWasi, &errmsg);
+  if (ptr == nullptr) {
+    std::string s(errmsg);
+    extism_plugin_new_error_free(errmsg);
+    throw Error(s);
+  }
+  this->compiled =
+      std::shared_ptr<ExtismCompiledPlugin>(ptr, extism_compiled_plugin_free);
+}
+
+CompiledPlugin::CompiledPlugin(std::string_view str, bool withWasi,
+                               std::vector<Function> functions)
+    : CompiledPlugin(reinterpret_cast<const uint8_t *>(str.data()), str.size(),
+                     withWasi, std::move(functions)) {}
+
+CompiledPlugin::CompiledPlugin(const std::vector<uint8_t> &data, bool withWasi,
+                               std::vector<Function> functions)
+    : CompiledPlugin(data.data(), data.size(), withWasi, std::move(functions)) {
+}
+
+static const Manifest &withoutFuelLimit(const Manifest &manifest) {
+  if (manifest.fuelLimit.has_value()) {
+    throw Error("Fuel limits are not supported by compiled plugins");
+  }
+  return manifest;
+}
+
+// Compile a plugin from Manifest, resolving modules through its module cache
+// like Plugin does
+CompiledPlugin::CompiledPlugin(const Manifest &manifest, bool withWasi,
+                               std::vector<Function> functions)
+    : CompiledPlugin(
+          withoutFuelLimit(manifest).moduleCache != nullptr
+              ? manifest.moduleCache->resolve(manifest).json(false)
+              : manifest.json(false),
+          withWasi, std::move(functions)) {}
+
+// Create a new plugin instance from the compiled module
+Plugin CompiledPlugin::instantiate() const { return Plugin(*this); }
+
+}; // namespace extism
@@ -0,0 +1,70 @@
+#include "extism.hpp"
+#include "json_writer.hpp"
+
+namespace extism {
+
+static std::shared_ptr<const std::string> encode(const ConfigChanges &changes) {
+  auto out = std::make_shared<std::string>();
+  size_t n = 2;
+  for (const auto &k : changes) {
+    n += k.first.size() + (k.second ? k.second->size() : 4) + 6;
+  }
+
+  JsonWriter w(*out);
+  w.reserve(n);
+  w.raw('{');
+  bool first = true;
+  for (const auto &k : changes) {
+    if (!first) {
+      w.raw(',');
+    }
+    first = false;
+    w.key(k.first);
+    if (k.second.has_value()) {
+      w.string(*k.second);
+    } else {
+      w.raw("null");
+    }
+  }
+  w.raw('}');
+  return out;
+}
+
+// Set every key in `config`
+ConfigBlob::ConfigBlob(const Config &config)
+    : ConfigBlob(ConfigChanges(config.begin(), config.end())) {}
+
+// Set or remove keys
+ConfigBlob::ConfigBlob(ConfigChanges changes)
+    : changes(std::make_shared<const ConfigChanges>(std::move(changes))),
+      encoded(encode(*this->changes)) {}
+
+// A new blob with `changes` applied on top of this one
+ConfigBlob ConfigBlob::with(const ConfigChanges &changes) const {
+  ConfigChanges merged = *this->changes;
+  for (const auto &k : changes) {
+    merged[k.first] = k.second;
+  }
+  return ConfigBlob(std::move(merged));
+}
+
+// Only the updates in this blob that differ from `previous`, keys set by
+// `previous` but not by this blob are removed
+ConfigBlob ConfigBlob::changedSince(const ConfigBlob &previous) const {
+  ConfigChanges delta;
+  for (const auto &k : *this->changes) {
+    auto it = previous.changes->find(k.first);
+    if (it == previous.changes->end() || it->second != k.second) {
+      delta.insert(k);
+    }
+  }
+  for (const auto &k : *previous.changes) {
+    if (k.second.has_value() &&
+        this->changes->find(k.first) == this->changes->end()) {
+      delta.emplace(k.first, std::nullopt);
+    }
+  }
+  return ConfigBlob(std::move(delta));
+}
+
+}; // namespace extism
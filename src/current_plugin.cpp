@@ -1,12 +1,16 @@
 
 #include "extism.hpp"
+#include <algorithm>
 #include <cstring>
 #include <string_view>
 
 namespace extism {
 
 uint8_t *CurrentPlugin::memory() const {
-  return extism_current_plugin_memory(this->pointer);
+  if (this->base == nullptr) {
+    this->base = extism_current_plugin_memory(this->pointer);
+  }
+  return this->base;
 }
 uint8_t *CurrentPlugin::memory(MemoryHandle offs) const {
   return this->memory() + offs;
@@ -17,9 +21,29 @@ ExtismSize CurrentPlugin::memoryLength(MemoryHandle offs) const {
 }
 
 MemoryHandle CurrentPlugin::memoryAlloc(ExtismSize size) const {
+  this->base = nullptr;
   return extism_current_plugin_memory_alloc(this->pointer, size);
 }
 
+MemoryHandle CurrentPlugin::memoryCopy(const uint8_t *bytes,
+                                       size_t len) const {
+  const auto before = reinterpret_cast<uintptr_t>(this->memory());
+  const auto offs = this->memoryAlloc(len);
+  if (offs == 0 && len > 0) {
+    throw Error("Unable to allocate plugin memory");
+  }
+  const auto after = this->memory();
+  // Memory only grows, and so moves, when the new block doesn't fit below
+  // the blocks already in use, so a view of plugin memory lies below `offs`
+  const auto address = reinterpret_cast<uintptr_t>(bytes);
+  if (reinterpret_cast<uintptr_t>(after) != before && address >= before &&
+      address - before < offs) {
+    bytes = after + (address - before);
+  }
+  memcpy(after + offs, bytes, len);
+  return offs;
+}
+
 void CurrentPlugin::memoryFree(MemoryHandle handle) const {
   extism_current_plugin_memory_free(this->pointer, handle);
 }
@@ -82,4 +106,142 @@ Val &CurrentPlugin::outputVal(size_t index) const {
   return this->outputs[index];
 }
 
+// View of the memory block at `offs`
+MemoryView CurrentPlugin::view(MemoryHandle offs) const {
+  return MemoryView(this->memory(offs), this->memoryLength(offs));
+}
+
+// View of the memory block passed as input `index`
+MemoryView CurrentPlugin::inputView(size_t index) const {
+  size_t length = 0;
+  auto ptr = this->inputBytes(&length, index);
+  if (ptr == nullptr) {
+    throw Error("Input is not a memory handle");
+  }
+  return MemoryView(ptr, length);
+}
+
+void *CurrentPlugin::hostContext() const {
+  return extism_current_plugin_host_context(this->pointer);
+}
+
+static void checkBounds(const MemoryView &view, size_t offset, size_t len) {
+  if (offset > view.length || len > view.length - offset) {
+    throw Error("Memory access out of bounds");
+  }
+}
+
+MemoryView MemoryView::subview(size_t offset, size_t len) const {
+  checkBounds(*this, offset, len);
+  return MemoryView(this->data + offset, len);
+}
+
+void MemoryView::write(size_t offset, const uint8_t *bytes,
+                       size_t len) const {
+  checkBounds(*this, offset, len);
+  memcpy(this->data + offset, bytes, len);
+}
+
+void MemoryView::write(size_t offset, std::string_view s) const {
+  this->write(offset, reinterpret_cast<const uint8_t *>(s.data()), s.size());
+}
+
+void MemoryView::read(size_t offset, uint8_t *bytes, size_t len) const {
+  checkBounds(*this, offset, len);
+  memcpy(bytes, this->data + offset, len);
+}
+
+OutputWriter::OutputWriter(const CurrentPlugin &plugin, size_t capacity,
+                           size_t index)
+    : plugin(plugin), index(index) {
+  // Throws if the output doesn't exist
+  plugin.outputVal(index);
+  this->reserve(capacity);
+}
+
+OutputWriter::~OutputWriter() { this->abandon(); }
+
+uint8_t *OutputWriter::data() const {
+  if (this->cap == 0) {
+    return nullptr;
+  }
+  return this->plugin.memory(this->handle);
+}
+
+void OutputWriter::reserve(size_t n) {
+  if (this->committed) {
+    throw Error("Output has already been committed");
+  }
+  if (n <= this->cap) {
+    return;
+  }
+  // Grow geometrically so repeated writes don't move the block every time
+  const size_t capacity = std::max(n, this->cap * 2);
+  const auto offs = this->plugin.memoryAlloc(capacity);
+  if (offs == 0) {
+    throw Error("Unable to allocate plugin memory");
+  }
+  if (this->cap > 0) {
+    memcpy(this->plugin.memory(offs), this->plugin.memory(this->handle),
+           this->len);
+    this->plugin.memoryFree(this->handle);
+  }
+  this->handle = offs;
+  this->cap = capacity;
+}
+
+uint8_t *OutputWriter::prepare(size_t n) {
+  this->reserve(this->len + n);
+  auto ptr = this->plugin.memory(this->handle) + this->len;
+  this->len += n;
+  return ptr;
+}
+
+void OutputWriter::write(const uint8_t *bytes, size_t n) {
+  memcpy(this->prepare(n), bytes, n);
+}
+
+void OutputWriter::write(std::string_view s) {
+  this->write(reinterpret_cast<const uint8_t *>(s.data()), s.size());
+}
+
+void OutputWriter::resize(size_t n) {
+  this->reserve(n);
+  this->len = n;
+}
+
+void OutputWriter::commit() {
+  if (this->committed) {
+    throw Error("Output has already been committed");
+  }
+  // The length of a block is what the plugin sees as the output length
+  if (this->len < this->cap || this->cap == 0) {
+    const auto offs = this->plugin.memoryAlloc(this->len);
+    if (offs == 0 && this->len > 0) {
+      // The block is kept, so the writer can still be committed or abandoned
+      throw Error("Unable to allocate plugin memory");
+    }
+    if (this->cap > 0) {
+      memcpy(this->plugin.memory(offs), this->plugin.memory(this->handle),
+             this->len);
+      this->plugin.memoryFree(this->handle);
+    }
+    this->handle = offs;
+    this->cap = this->len;
+  }
+  this->plugin.outputVal(this->index).v.i64 = this->handle;
+  this->committed = true;
+}
+
+void OutputWriter::abandon() {
+  if (this->committed) {
+    return;
+  }
+  if (this->cap > 0) {
+    this->plugin.memoryFree(this->handle);
+  }
+  this->cap = 0;
+  this->len = 0;
+}
+
 }; // namespace extism
@@ -0,0 +1,232 @@
+#include "extism.hpp"
+#include "timer_wheel.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+
+namespace extism {
+
+struct Executor::Impl {
+  struct Worker {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::vector<std::thread> threads;
+  std::atomic<size_t> next{0};
+
+  // Only taken by workers going to sleep and by pushes that find one
+  // asleep
+  std::mutex sleepMutex;
+  std::condition_variable wake;
+  std::atomic<size_t> sleepers{0};
+  bool stop = false;
+
+  // The executor and worker index of the current thread, if it is a worker
+  static thread_local Impl *current;
+  static thread_local size_t currentIndex;
+
+  explicit Impl(size_t n) {
+    for (size_t i = 0; i < n; i++) {
+      workers.push_back(std::make_unique<Worker>());
+    }
+    for (size_t i = 0; i < n; i++) {
+      threads.emplace_back([this, i]() { this->run(i); });
+    }
+  }
+
+  ~Impl() {
+    {
+      std::lock_guard<std::mutex> lock(sleepMutex);
+      stop = true;
+    }
+    wake.notify_all();
+    for (auto &t : threads) {
+      t.join();
+    }
+  }
+
+  void push(std::function<void()> task) {
+    const size_t index = current == this
+                             ? currentIndex
+                             : next.fetch_add(1, std::memory_order_relaxed) %
+                                   workers.size();
+    {
+      std::lock_guard<std::mutex> lock(workers[index]->mutex);
+      workers[index]->tasks.push_back(std::move(task));
+    }
+    // Pairs with the increment in run: either a worker going to sleep sees
+    // the task when it looks again, or we see it counted as asleep
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleepers.load() > 0) {
+      // Once we hold the lock the sleeper is waiting, so it gets the notify
+      { std::lock_guard<std::mutex> lock(sleepMutex); }
+      wake.notify_one();
+    }
+  }
+
+  // Pop from the back of our own queue, or steal from the front of another
+  bool take(size_t index, std::function<void()> &task) {
+    {
+      auto &own = *workers[index];
+      std::lock_guard<std::mutex> lock(own.mutex);
+      if (!own.tasks.empty()) {
+        task = std::move(own.tasks.back());
+        own.tasks.pop_back();
+        return true;
+      }
+    }
+    for (size_t i = 1; i < workers.size(); i++) {
+      auto &victim = *workers[(index + i) % workers.size()];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.tasks.empty()) {
+        task = std::move(victim.tasks.front());
+        victim.tasks.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void run(size_t index) {
+    current = this;
+    currentIndex = index;
+    std::function<void()> task;
+    for (;;) {
+      if (!take(index, task)) {
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        sleepers.fetch_add(1);
+        // Look again now that pushes will wake us, every task queued before
+        // stop still runs
+        const bool found = take(index, task);
+        if (!found && !stop) {
+          wake.wait(lock);
+        }
+        sleepers.fetch_sub(1);
+        if (!found) {
+          if (stop) {
+            return;
+          }
+          continue;
+        }
+      }
+      task();
+      task = nullptr;
+    }
+  }
+};
+
+thread_local Executor::Impl *Executor::Impl::current = nullptr;
+thread_local size_t Executor::Impl::currentIndex = 0;
+
+static size_t defaultThreads(size_t threads) {
+  if (threads > 0) {
+    return threads;
+  }
+  return std::max<size_t>(1, std::thread::hardware_concurrency());
+}
+
+Executor::Executor(size_t threads)
+    : impl(std::make_unique<Impl>(defaultThreads(threads))) {}
+
+Executor::~Executor() = default;
+
+// Queue a task, tasks queued from a worker thread run on that worker unless
+// another worker steals them
+void Executor::submit(std::function<void()> task) {
+  impl->push(std::move(task));
+}
+
+// Number of worker threads
+size_t Executor::threads() const { return impl->threads.size(); }
+
+static std::mutex sharedMutex;
+static size_t sharedThreads = 0;
+static bool sharedStarted = false;
+
+// The executor owned by the library, used when no executor is given to
+// callAsync. It is started on first use
+Executor &Executor::shared() {
+  static Executor *executor = []() {
+    std::lock_guard<std::mutex> lock(sharedMutex);
+    sharedStarted = true;
+    // Never freed, tasks may still be running during static destruction
+    return new Executor(sharedThreads);
+  }();
+  return *executor;
+}
+
+// Set the number of worker threads of the shared executor, throws if it has
+// already been started
+void Executor::configureShared(size_t threads) {
+  std::lock_guard<std::mutex> lock(sharedMutex);
+  if (sharedStarted) {
+    throw Error("Shared executor has already been started");
+  }
+  sharedThreads = threads;
+}
+
+CallFuture::CallFuture(std::shared_ptr<State> state)
+    : state(std::move(state)), future(this->state->promise.get_future()) {}
+
+// Wait for the call to finish and take its output, rethrows any error
+std::vector<uint8_t> CallFuture::get() { return future.get(); }
+
+// Wait for the call to finish
+void CallFuture::wait() const { future.wait(); }
+
+// Returns true if the call has finished
+bool CallFuture::ready() const {
+  return future.wait_for(std::chrono::seconds(0)) ==
+         std::future_status::ready;
+}
+
+void CallFuture::State::start(const ExtismCancelHandle *handle) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  if (this->cancelled) {
+    throw Error("Call cancelled");
+  }
+  this->handle = handle;
+}
+
+void CallFuture::State::finish() {
+  std::shared_ptr<void> canceller;
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->handle = nullptr;
+    canceller = std::move(this->canceller);
+  }
+  // The timer is removed here, before the plugin can go away
+}
+
+static void cancelCall(void *handle) {
+  extism_plugin_cancel(static_cast<const ExtismCancelHandle *>(handle));
+}
+
+// Cancel the call, if it is running it is interrupted using its plugin's
+// CancelHandle. libextism drops a cancel that arrives before the call has
+// started, so it is repeated on every timer wheel tick until the call
+// returns. Returns false if the call had already finished
+bool CallFuture::cancel() {
+  if (!future.valid() || this->ready()) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(state->mutex);
+  state->cancelled = true;
+  if (state->handle != nullptr && state->canceller == nullptr) {
+    extism_plugin_cancel(state->handle);
+    auto &wheel = TimerWheel::shared();
+    const auto timer =
+        wheel.add(std::chrono::steady_clock::now(), cancelCall,
+                  const_cast<ExtismCancelHandle *>(state->handle), true);
+    state->canceller = std::shared_ptr<void>(
+        nullptr, [timer](void *) { TimerWheel::shared().remove(timer); });
+  }
+  return true;
+}
+
+}; // namespace extism
@@ -1,15 +1,24 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <extism.h>
 #include <filesystem>
 #include <functional>
+#include <future>
+#include <iosfwd>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <variant>
 #include <vector>
 
@@ -21,14 +30,71 @@ public:
   Error(const char *msg) : std::runtime_error(msg) {}
 };
 
+// Thrown when a call is cancelled because its deadline passed
+class TimeoutError : public Error {
+public:
+  using Error::Error;
+};
+
+// Thrown when a call runs out of fuel
+class FuelExhausted : public Error {
+public:
+  using Error::Error;
+};
+
+// The time by which a call must finish
+typedef std::chrono::steady_clock::time_point Deadline;
+
 typedef std::map<std::string, std::string> Config;
 
+// Config updates, a key mapped to std::nullopt is removed
+typedef std::map<std::string, std::optional<std::string>> ConfigChanges;
+
+// Config updates serialized once, so they can be applied to any number of
+// plugins without encoding them again. Copies share the encoded data
+class ConfigBlob {
+  std::shared_ptr<const ConfigChanges> changes;
+  std::shared_ptr<const std::string> encoded;
+
+public:
+  // Set every key in `config`
+  ConfigBlob(const Config &config = {});
+
+  // Set or remove keys
+  ConfigBlob(ConfigChanges changes);
+
+  // A new blob with `changes` applied on top of this one
+  ConfigBlob with(const ConfigChanges &changes) const;
+
+  // Only the updates in this blob that differ from `previous`, keys set by
+  // `previous` but not by this blob are removed. Applying the result to a
+  // plugin configured with `previous` has the same effect as applying this
+  // blob
+  ConfigBlob changedSince(const ConfigBlob &previous) const;
+
+  // The updates in this blob
+  const ConfigChanges &entries() const { return *changes; }
+
+  // The serialized updates, as passed to libextism
+  std::string_view json() const { return *encoded; }
+};
+
+// Receives serialized JSON in chunks
+typedef std::function<void(std::string_view)> JsonSink;
+
 class WasmBytes {
   using DataSource =
       std::variant<std::vector<uint8_t>, std::shared_ptr<const uint8_t[]>>;
   DataSource src;
   size_t srcSize;
 
+  struct Digest {
+    std::once_flag once;
+    std::string hex;
+  };
+  // Shared by copies, which hold the same bytes
+  std::shared_ptr<Digest> digest = std::make_shared<Digest>();
+
 public:
   WasmBytes(std::shared_ptr<const uint8_t[]> src, const size_t srcSize)
       : src(std::move(src)), srcSize(srcSize) {}
@@ -37,7 +103,11 @@ public:
         srcSize(std::get<std::vector<uint8_t>>(this->src).size()) {}
   WasmBytes(const uint8_t *src, const size_t srcSize)
       : WasmBytes(std::vector<uint8_t>(src, src + srcSize)) {}
-  // DANGEROUS, src must remain valid
+  // Map a file read-only instead of reading it. Copies share the mapping,
+  // which is unmapped with the last one, and plugins created from it share
+  // the page cache. The file must not be truncated while it's mapped
+  static WasmBytes mapFile(const std::filesystem::path &path);
+  // DANGEROUS, src must remain valid, and unchanged once it has been hashed
   static WasmBytes CreateWithoutOwnership(const uint8_t *src,
                                           const size_t srcSize) {
     return WasmBytes(std::shared_ptr<const uint8_t[]>(
@@ -52,8 +122,16 @@ public:
   }
 
   size_t getSize() const { return srcSize; }
+
+  // Hex SHA-256 of the bytes, computed on first use and remembered by every
+  // copy
+  std::string sha256() const;
 };
 
+// Pass as the hash of Wasm::bytes to compute it from the bytes
+struct AutoHash {};
+inline constexpr AutoHash autoHash{};
+
 class WasmURL {
 public:
   std::string url;
@@ -99,6 +177,9 @@ public:
                   std::string method = "GET",
                   std::map<std::string, std::string> headers = {});
 
+  // Create Wasm from a memory-mapped file, see WasmBytes::mapFile
+  static Wasm mmap(const std::string &path, std::string hash = std::string());
+
   // Create Wasm from bytes of a module
   static Wasm bytes(const uint8_t *data, const size_t len,
                     std::string hash = std::string());
@@ -107,9 +188,17 @@ public:
   static Wasm bytes(const std::vector<uint8_t> &data,
                     std::string hash = std::string());
 
+  // Create Wasm from bytes of a module, with their SHA-256 as the hash
+  static Wasm bytes(const uint8_t *data, const size_t len, AutoHash);
+  static Wasm bytes(const std::vector<uint8_t> &data, AutoHash);
+
   friend class Serializer;
+  friend class Manifest;
+  friend class ModuleCache;
 };
 
+class ModuleCache;
+
 class Manifest {
 public:
   Config config;
@@ -117,6 +206,11 @@ public:
   std::vector<std::string> allowedHosts;
   std::map<std::string, std::string> allowedPaths;
   std::optional<uint64_t> timeout;
+  // Not part of the JSON, used when a Plugin is created from the manifest
+  std::optional<uint64_t> fuelLimit;
+  // Not part of the JSON, modules with a hash are looked up in the cache
+  // before a Plugin or CompiledPlugin is created from the manifest
+  std::shared_ptr<ModuleCache> moduleCache;
 
   Manifest(std::vector<Wasm> wasm = {}) : wasm(std::move(wasm)) {}
 
@@ -133,6 +227,10 @@ public:
 
   std::string json(const bool selfContained = true) const;
 
+  // Write the JSON encoding of the manifest to `sink` in chunks, instead of
+  // building it in one string
+  void json(const JsonSink &sink, const bool selfContained = true) const;
+
   // Add Wasm
   void addWasm(Wasm wasm);
 
@@ -156,16 +254,122 @@ public:
   // Set timeout in milliseconds
   void setTimeout(uint64_t ms);
 
+  // Limit the fuel, roughly the number of Wasm instructions, each call may
+  // use. Calls that run out throw FuelExhausted
+  void setFuelLimit(uint64_t fuel);
+
+  // Fill in the hash of every path and bytes module that doesn't have one,
+  // so libextism verifies it. Modules are hashed in parallel on the shared
+  // Executor, and bytes that have been hashed before aren't hashed again
+  void computeHashes();
+
+  // Look up modules with a hash in `cache`, see ModuleCache
+  void setModuleCache(std::shared_ptr<ModuleCache> cache);
+
   // Set config key/value
   void setConfig(std::string k, std::string v);
 };
 
+// A directory of Wasm modules stored under their SHA-256, shared by every
+// process using the same directory. Entries are written to a temporary file
+// and renamed into place, so readers never see a partial entry. Each cache
+// checks an entry against its hash the first time it reads it, and again
+// only if the file's inode or size changes, so a corrupted entry is removed
+// and treated as a miss. When the entries grow past `maxBytes` the least
+// recently used ones are removed.
+//
+// libextism can't load or store compiled modules, so the compiled code is
+// cached by wasmtime, see enableCompiledCache
+class ModuleCache {
+  const std::filesystem::path root;
+  const uint64_t maxBytes;
+  std::atomic<uint64_t> hits{0};
+  std::atomic<uint64_t> misses{0};
+  std::atomic<uint64_t> corrupted{0};
+  std::atomic<uint64_t> evicted{0};
+  // Inode and size of the entries whose contents have been checked
+  std::mutex verifiedMutex;
+  std::map<std::string, std::pair<uint64_t, uint64_t>> verified;
+
+  std::filesystem::path entry(const std::string &hash) const;
+  std::string put(const uint8_t *data, size_t len, std::string hash);
+  void trimLocked();
+
+public:
+  struct Stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t corrupted;
+    uint64_t evicted;
+  };
+
+  // Creates `directory` if it doesn't exist
+  ModuleCache(std::filesystem::path directory,
+              uint64_t maxBytes = uint64_t(1) << 30);
+  ModuleCache(const ModuleCache &) = delete;
+  ModuleCache &operator=(const ModuleCache &) = delete;
+
+  const std::filesystem::path &directory() const { return root; }
+
+  // The module with the given hex SHA-256, or nothing on a miss
+  std::optional<WasmBytes> get(const std::string &hash);
+
+  // Store a module, returns its hex SHA-256
+  std::string put(const uint8_t *data, size_t len);
+  std::string put(const std::vector<uint8_t> &data);
+
+  // A copy of `manifest` where each URL module with a hash that is cached is
+  // replaced by its bytes, so it isn't downloaded. Modules that miss, and
+  // path and bytes modules, which are already local, are left to libextism.
+  // Entries are added with put, by whatever downloads the modules
+  Manifest resolve(const Manifest &manifest);
+
+  // Remove the least recently used entries until at most `maxBytes` remain
+  void trim();
+
+  // Total size of the entries
+  uint64_t size() const;
+
+  Stats stats() const;
+
+  // Have wasmtime keep compiled code in the `compiled` subdirectory, with
+  // the same size limit. This writes a wasmtime cache config and points
+  // EXTISM_CACHE_CONFIG at it, so it applies to every plugin the process
+  // creates afterwards. Call it before creating plugins or threads
+  void enableCompiledCache() const;
+};
+
+// A view of memory owned by someone else. A Buffer returned by Plugin::call
+// points into plugin memory and is only valid until the next call or reset,
+// define EXTISM_CPP_CHECK_BUFFERS to detect use after that
 class Buffer {
+#ifdef EXTISM_CPP_CHECK_BUFFERS
+  std::shared_ptr<const std::atomic<uint64_t>> generation;
+  uint64_t expected = 0;
+#endif
+
 public:
   Buffer(const uint8_t *ptr, size_t len) : data(ptr), length(len) {}
+#ifdef EXTISM_CPP_CHECK_BUFFERS
+  Buffer(const uint8_t *ptr, size_t len,
+         std::shared_ptr<const std::atomic<uint64_t>> generation)
+      : generation(std::move(generation)), data(ptr), length(len) {
+    this->expected = this->generation->load();
+  }
+#endif
   const uint8_t *const data;
   const size_t length;
 
+  // Returns false if the memory has been invalidated by a later call or
+  // reset. Always true unless EXTISM_CPP_CHECK_BUFFERS is defined
+  bool valid() const {
+#ifdef EXTISM_CPP_CHECK_BUFFERS
+    return generation == nullptr || generation->load() == expected;
+#else
+    return true;
+#endif
+  }
+
   std::string_view string() const {
     return static_cast<std::string_view>(*this);
   }
@@ -175,11 +379,89 @@ public:
   }
 
   operator std::string_view() const {
+    check();
     return std::string_view(reinterpret_cast<const char *>(data), length);
   }
   operator std::vector<uint8_t>() const {
+    check();
     return std::vector<uint8_t>(data, data + length);
   }
+
+private:
+  void check() const {
+#ifdef EXTISM_CPP_CHECK_BUFFERS
+    if (!valid()) {
+      throw Error("Buffer used after the plugin was called again or reset");
+    }
+#endif
+  }
+};
+
+// Call output copied out of plugin memory. Storage is recycled through a
+// small per-thread free list, so steady-state calls don't allocate
+class OwnedBuffer {
+  std::vector<uint8_t> storage;
+
+public:
+  OwnedBuffer() = default;
+  // Copy `length` bytes into storage taken from this thread's free list
+  OwnedBuffer(const uint8_t *data, size_t length);
+  explicit OwnedBuffer(const Buffer &buf) : OwnedBuffer(buf.data, buf.length) {}
+  OwnedBuffer(OwnedBuffer &&) noexcept = default;
+  OwnedBuffer &operator=(OwnedBuffer &&b) noexcept;
+  OwnedBuffer(const OwnedBuffer &) = delete;
+  OwnedBuffer &operator=(const OwnedBuffer &) = delete;
+  // Returns the storage to the current thread's free list
+  ~OwnedBuffer();
+
+  const uint8_t *data() const { return storage.data(); }
+  size_t length() const { return storage.size(); }
+
+  std::string_view string() const {
+    return static_cast<std::string_view>(*this);
+  }
+
+  // Take the storage, it won't be recycled
+  std::vector<uint8_t> release() { return std::move(storage); }
+
+  operator std::string_view() const {
+    return std::string_view(reinterpret_cast<const char *>(storage.data()),
+                            storage.size());
+  }
+  operator Buffer() const { return Buffer(storage.data(), storage.size()); }
+};
+
+// Outputs of Plugin::callBatch, packed into one contiguous buffer
+class BatchResult {
+  std::vector<uint8_t> arena;
+  // Output `i` is stored at [offsets[i], offsets[i + 1])
+  std::vector<size_t> offsets{0};
+  // Index and error message of each failed input, ordered by index
+  std::vector<std::pair<size_t, std::string>> errors;
+
+  friend class Plugin;
+
+public:
+  // Number of inputs
+  size_t size() const { return offsets.size() - 1; }
+
+  // Output for input `index`, empty if the call failed. It stays valid for
+  // the lifetime of the BatchResult
+  Buffer operator[](size_t index) const;
+
+  // Returns true if the call for input `index` succeeded
+  bool ok(size_t index) const;
+
+  // Failed inputs and their error messages, ordered by index
+  const std::vector<std::pair<size_t, std::string>> &failures() const {
+    return errors;
+  }
+
+  // All outputs, back to back
+  const std::vector<uint8_t> &data() const { return arena; }
+
+  // Offsets of each output into data(), with a final entry for the end
+  const std::vector<size_t> &offsetTable() const { return offsets; }
 };
 
 typedef ExtismValType ValType;
@@ -187,12 +469,38 @@ typedef ExtismValUnion ValUnion;
 typedef ExtismVal Val;
 typedef uint64_t MemoryHandle;
 
+// A bounds-checked view of a block of plugin memory. Like the pointers
+// returned by CurrentPlugin::memory, it is only valid until the plugin
+// allocates memory or the host function returns
+class MemoryView {
+public:
+  MemoryView(uint8_t *ptr, size_t len) : data(ptr), length(len) {}
+  uint8_t *const data;
+  const size_t length;
+
+  // Part of the view, throws if it is out of bounds
+  MemoryView subview(size_t offset, size_t len) const;
+  // Copy `len` bytes into the view at `offset`, throws if out of bounds
+  void write(size_t offset, const uint8_t *bytes, size_t len) const;
+  void write(size_t offset, std::string_view s) const;
+  // Copy `len` bytes from the view at `offset`, throws if out of bounds
+  void read(size_t offset, uint8_t *bytes, size_t len) const;
+
+  std::string_view string() const {
+    return std::string_view(reinterpret_cast<const char *>(data), length);
+  }
+  operator Buffer() const { return Buffer(data, length); }
+};
+
 class CurrentPlugin {
   ExtismCurrentPlugin *const pointer;
   const ExtismVal *const inputs;
   const size_t nInputs;
   ExtismVal *const outputs;
   const size_t nOutputs;
+  // Base address of plugin memory, looked up on first use and again after
+  // memoryAlloc, which may grow memory
+  mutable uint8_t *base = nullptr;
 
 public:
   CurrentPlugin(ExtismCurrentPlugin *p, const ExtismVal *inputs, size_t nInputs,
@@ -204,6 +512,9 @@ public:
   uint8_t *memory(MemoryHandle offs) const;
   ExtismSize memoryLength(MemoryHandle offs) const;
   MemoryHandle memoryAlloc(ExtismSize size) const;
+  // Allocate a block holding a copy of `len` bytes, which may themselves be
+  // in plugin memory. Throws if the block can't be allocated
+  MemoryHandle memoryCopy(const uint8_t *bytes, size_t len) const;
   void memoryFree(MemoryHandle handle) const;
   bool output(std::string_view s, size_t index = 0) const;
   bool output(const uint8_t *bytes, size_t len, size_t index = 0) const;
@@ -212,24 +523,436 @@ public:
   std::string_view inputStringView(size_t index = 0) const;
   const Val &inputVal(size_t index) const;
   Val &outputVal(size_t index) const;
+  MemoryView view(MemoryHandle offs) const;
+  MemoryView inputView(size_t index = 0) const;
+
+  // The context passed to the running Plugin::call, nullptr if there is
+  // none
+  void *hostContext() const;
+  template <typename T> T *hostContext() const {
+    return static_cast<T *>(this->hostContext());
+  }
+};
+
+// Builds a host function output directly in plugin memory, avoiding the
+// copy made by CurrentPlugin::output:
+//   OutputWriter out(plugin, row.size());
+//   row.serialize(out.prepare(row.size()));
+//   out.commit();
+// The block is freed if the writer is destroyed without being committed.
+// libextism can't resize a block, so the copy is only avoided when exactly
+// the capacity is written: growing and an over-reserve both cost a copy of
+// the output
+class OutputWriter {
+  const CurrentPlugin &plugin;
+  const size_t index;
+  MemoryHandle handle = 0;
+  size_t cap = 0;
+  size_t len = 0;
+  bool committed = false;
+
+public:
+  // Reserve `capacity` bytes for output `index`
+  OutputWriter(const CurrentPlugin &plugin, size_t capacity = 0,
+               size_t index = 0);
+  OutputWriter(const OutputWriter &) = delete;
+  OutputWriter &operator=(const OutputWriter &) = delete;
+  ~OutputWriter();
+
+  // Bytes written so far
+  uint8_t *data() const;
+  size_t size() const { return len; }
+  size_t capacity() const { return cap; }
+
+  // Make room for at least `n` bytes in total. Growing allocates a new block
+  // and copies what has been written, the capacity at least doubles so the
+  // copies add up to less than twice the final size
+  void reserve(size_t n);
+  // Returns a pointer to `n` writable bytes at the end of the output and
+  // counts them as written
+  uint8_t *prepare(size_t n);
+  void write(const uint8_t *bytes, size_t n);
+  void write(std::string_view s);
+  // Set the number of bytes written, growing the block if needed
+  void resize(size_t n);
+
+  // Set the output to what has been written. The output length is the
+  // length of its block, so if less than the capacity was written the whole
+  // output is copied to a new block of the exact size. Throws if that block
+  // can't be allocated, without committing
+  void commit();
+  // Free the block without setting the output
+  void abandon();
 };
 
 typedef std::function<void(CurrentPlugin, void *user_data)> FunctionType;
 
+// Conversion between a C++ type and a Wasm value, used by Function::make to
+// derive host function signatures. `get` reads an argument and `set` writes
+// a result. Specialize it to pass other types to host functions
+template <typename T> struct HostValue;
+
+template <> struct HostValue<int32_t> {
+  static constexpr ValType type = ValType::ExtismValType_I32;
+  static int32_t get(const CurrentPlugin &, const Val &v) { return v.v.i32; }
+  static void set(const CurrentPlugin &, Val &v, int32_t x) { v.v.i32 = x; }
+};
+
+template <> struct HostValue<uint32_t> {
+  static constexpr ValType type = ValType::ExtismValType_I32;
+  static uint32_t get(const CurrentPlugin &, const Val &v) {
+    return static_cast<uint32_t>(v.v.i32);
+  }
+  static void set(const CurrentPlugin &, Val &v, uint32_t x) {
+    v.v.i32 = static_cast<int32_t>(x);
+  }
+};
+
+template <> struct HostValue<int64_t> {
+  static constexpr ValType type = ValType::ExtismValType_I64;
+  static int64_t get(const CurrentPlugin &, const Val &v) { return v.v.i64; }
+  static void set(const CurrentPlugin &, Val &v, int64_t x) { v.v.i64 = x; }
+};
+
+// Also MemoryHandle, passed through without reading plugin memory
+template <> struct HostValue<uint64_t> {
+  static constexpr ValType type = ValType::ExtismValType_I64;
+  static uint64_t get(const CurrentPlugin &, const Val &v) {
+    return static_cast<uint64_t>(v.v.i64);
+  }
+  static void set(const CurrentPlugin &, Val &v, uint64_t x) {
+    v.v.i64 = static_cast<int64_t>(x);
+  }
+};
+
+template <> struct HostValue<float> {
+  static constexpr ValType type = ValType::ExtismValType_F32;
+  static float get(const CurrentPlugin &, const Val &v) { return v.v.f32; }
+  static void set(const CurrentPlugin &, Val &v, float x) { v.v.f32 = x; }
+};
+
+template <> struct HostValue<double> {
+  static constexpr ValType type = ValType::ExtismValType_F64;
+  static double get(const CurrentPlugin &, const Val &v) { return v.v.f64; }
+  static void set(const CurrentPlugin &, Val &v, double x) { v.v.f64 = x; }
+};
+
+// Plugin memory passed by handle, arguments point into plugin memory and
+// results are copied into a new block
+template <> struct HostValue<std::string_view> {
+  static constexpr ValType type = ValType::ExtismValType_I64;
+  static std::string_view get(const CurrentPlugin &plugin, const Val &v) {
+    return std::string_view(
+        reinterpret_cast<const char *>(plugin.memory(v.v.i64)),
+        plugin.memoryLength(v.v.i64));
+  }
+  static void set(const CurrentPlugin &plugin, Val &v, std::string_view x) {
+    v.v.i64 = plugin.memoryCopy(reinterpret_cast<const uint8_t *>(x.data()),
+                                x.size());
+  }
+};
+
+template <> struct HostValue<Buffer> {
+  static constexpr ValType type = ValType::ExtismValType_I64;
+  static Buffer get(const CurrentPlugin &plugin, const Val &v) {
+    return Buffer(plugin.memory(v.v.i64), plugin.memoryLength(v.v.i64));
+  }
+  static void set(const CurrentPlugin &plugin, Val &v, const Buffer &x) {
+    v.v.i64 = plugin.memoryCopy(x.data, x.length);
+  }
+};
+
+template <> struct HostValue<std::string> {
+  static constexpr ValType type = ValType::ExtismValType_I64;
+  static std::string get(const CurrentPlugin &plugin, const Val &v) {
+    return std::string(HostValue<std::string_view>::get(plugin, v));
+  }
+  static void set(const CurrentPlugin &plugin, Val &v, const std::string &x) {
+    HostValue<std::string_view>::set(plugin, v, x);
+  }
+};
+
+template <> struct HostValue<std::vector<uint8_t>> {
+  static constexpr ValType type = ValType::ExtismValType_I64;
+  static std::vector<uint8_t> get(const CurrentPlugin &plugin, const Val &v) {
+    return HostValue<Buffer>::get(plugin, v).vector();
+  }
+  static void set(const CurrentPlugin &plugin, Val &v,
+                  const std::vector<uint8_t> &x) {
+    HostValue<Buffer>::set(plugin, v, Buffer(x.data(), x.size()));
+  }
+};
+
+// Signature of a callable, split into return and argument types. A leading
+// CurrentPlugin parameter is not part of the Wasm signature
+template <typename F> struct HostSignature;
+
+template <typename R, typename... Args> struct HostSignature<R(Args...)> {
+  using Result = R;
+  using Params = std::tuple<std::decay_t<Args>...>;
+  static constexpr bool withPlugin = false;
+};
+
+template <typename R, typename... Args>
+struct HostSignature<R(CurrentPlugin, Args...)> : HostSignature<R(Args...)> {
+  static constexpr bool withPlugin = true;
+};
+
+template <typename R, typename... Args>
+struct HostSignature<R(CurrentPlugin &, Args...)>
+    : HostSignature<R(CurrentPlugin, Args...)> {};
+
+template <typename R, typename... Args>
+struct HostSignature<R(const CurrentPlugin &, Args...)>
+    : HostSignature<R(CurrentPlugin, Args...)> {};
+
+template <typename R, typename... Args>
+struct HostSignature<R (*)(Args...)> : HostSignature<R(Args...)> {};
+
+template <typename R, typename... Args>
+struct HostSignature<R (*)(Args...) noexcept> : HostSignature<R(Args...)> {};
+
+template <typename C, typename R, typename... Args>
+struct HostSignature<R (C::*)(Args...)> : HostSignature<R(Args...)> {};
+
+template <typename C, typename R, typename... Args>
+struct HostSignature<R (C::*)(Args...) const> : HostSignature<R(Args...)> {};
+
+template <typename C, typename R, typename... Args>
+struct HostSignature<R (C::*)(Args...) noexcept> : HostSignature<R(Args...)> {
+};
+
+template <typename C, typename R, typename... Args>
+struct HostSignature<R (C::*)(Args...) const noexcept>
+    : HostSignature<R(Args...)> {};
+
+// A traced operation, passed to Tracer::begin and Tracer::end
+struct Span {
+  enum class Kind { Call, HostFunction, Reset, Create };
+
+  Kind kind;
+  // Export or host function name, empty for Reset and Create
+  std::string_view name;
+  // Input size of calls, or the module size for Create
+  uint64_t inputBytes = 0;
+  // Output size of calls, set before end
+  uint64_t outputBytes = 0;
+  // Number of spans already open on this thread when this one began
+  uint32_t depth = 0;
+  // Set by the innermost TraceContext on this thread
+  const void *context = nullptr;
+  // Set before end if the operation failed
+  bool error = false;
+};
+
+// Receives spans around guest calls, host functions, resets and plugin
+// creation. Both methods are called on the thread doing the work and must
+// be thread-safe
+class Tracer {
+public:
+  virtual ~Tracer() = default;
+  virtual void begin(const Span &span) = 0;
+  virtual void end(const Span &span) = 0;
+
+  // Install `tracer` for all plugins, or remove it with nullptr. It must
+  // outlive every span started while it is installed
+  static void set(Tracer *tracer);
+
+  static std::atomic<Tracer *> active;
+};
+
+// Attaches a caller-supplied context, such as a request or trace id, to the
+// spans started on this thread while it is in scope
+class TraceContext {
+  const void *previous;
+
+public:
+  explicit TraceContext(const void *context);
+  ~TraceContext();
+  TraceContext(const TraceContext &) = delete;
+  TraceContext &operator=(const TraceContext &) = delete;
+
+  // Context of the spans started on this thread
+  static const void *current();
+};
+
+// Reports a span to the installed tracer for the lifetime of the scope.
+// When no tracer is installed this is a single branch
+class TraceSpan {
+  Tracer *tracer;
+  Span span;
+  int exceptions = 0;
+
+  void begin();
+  void end();
+
+public:
+  TraceSpan(Span::Kind kind, std::string_view name, uint64_t inputBytes = 0)
+      : tracer(Tracer::active.load(std::memory_order_acquire)) {
+    if (tracer != nullptr) {
+      span.kind = kind;
+      span.name = name;
+      span.inputBytes = inputBytes;
+      begin();
+    }
+  }
+  ~TraceSpan() {
+    if (tracer != nullptr) {
+      end();
+    }
+  }
+  TraceSpan(const TraceSpan &) = delete;
+  TraceSpan &operator=(const TraceSpan &) = delete;
+
+  bool active() const { return tracer != nullptr; }
+  void output(uint64_t bytes) { span.outputBytes = bytes; }
+  // Mark the span as failed, spans ended by an exception are marked
+  // automatically
+  void failed() { span.error = true; }
+};
+
+#ifdef EXTISM_CPP_METRICS
+// Times a host function call and records it in the metrics of the plugin
+// making the call, used by Function
+class HostCallMetrics {
+  const std::string &name;
+  uint64_t start = 0;
+  bool ok = false;
+
+public:
+  explicit HostCallMetrics(const std::string &name);
+  ~HostCallMetrics();
+  void succeeded() { ok = true; }
+};
+#endif
+
 class Function {
 public:
   struct UserData {
     FunctionType func;
     void *userData = NULL;
     std::function<void(void *)> freeUserData;
+    std::string name;
   };
 
 private:
   std::shared_ptr<ExtismFunction> func;
   std::string name;
-  UserData userData;
+  // Keeps user data owned by something else, like a HostFunctionTable,
+  // alive for as long as the function is
+  std::shared_ptr<const void> owner;
+
+  friend class HostFunctionTable;
+
+  Function(std::string name, const std::vector<ValType> &inputs,
+           const std::vector<ValType> &outputs, ExtismFunctionType callback,
+           void *userData, void (*free)(void *));
+
+  // Converts arguments and the result of `f` based on `Sig`, called directly
+  // by libextism without going through FunctionType
+  template <typename Sig, typename F, size_t... I>
+  static void invoke(F &f, const std::string &name, ExtismCurrentPlugin *p,
+                     const ExtismVal *inputs, ExtismSize nInputs,
+                     ExtismVal *outputs, ExtismSize nOutputs,
+                     std::index_sequence<I...>) {
+    using Params = typename Sig::Params;
+    using Result = typename Sig::Result;
+#ifdef EXTISM_CPP_METRICS
+    HostCallMetrics metrics(name);
+#endif
+    TraceSpan trace(Span::Kind::HostFunction, name);
+    CurrentPlugin plugin(p, inputs, nInputs, outputs, nOutputs);
+    auto call = [&]() -> decltype(auto) {
+      if constexpr (Sig::withPlugin) {
+        return f(plugin, HostValue<std::tuple_element_t<I, Params>>::get(
+                             plugin, inputs[I])...);
+      } else {
+        return f(HostValue<std::tuple_element_t<I, Params>>::get(plugin,
+                                                                 inputs[I])...);
+      }
+    };
+    if constexpr (std::is_void_v<Result>) {
+      call();
+    } else {
+      HostValue<std::decay_t<Result>>::set(plugin, outputs[0], call());
+    }
+#ifdef EXTISM_CPP_METRICS
+    metrics.succeeded();
+#endif
+  }
+
+  // User data of a host function created from a callable
+  template <typename Fn> struct Bound {
+    std::string name;
+    Fn f;
+  };
+
+  template <typename Sig>
+  static Function makeWith(std::string name, ExtismFunctionType callback,
+                           void *userData, void (*free)(void *)) {
+    using Params = typename Sig::Params;
+    using Result = typename Sig::Result;
+    auto inputs = paramTypes<Params>(
+        std::make_index_sequence<std::tuple_size_v<Params>>());
+    std::vector<ValType> outputs;
+    if constexpr (!std::is_void_v<Result>) {
+      outputs.push_back(HostValue<std::decay_t<Result>>::type);
+    }
+    return Function(std::move(name), inputs, outputs, callback, userData, free);
+  }
+
+  template <typename Params, size_t... I>
+  static std::vector<ValType> paramTypes(std::index_sequence<I...>) {
+    return {HostValue<std::tuple_element_t<I, Params>>::type...};
+  }
 
 public:
+  // Create a host function from a function pointer, the Wasm signature is
+  // derived from its parameter and return types using HostValue. It is
+  // called without any allocation or type erasure:
+  //   int64_t add(int64_t a, int64_t b);
+  //   Function::make<&add>("add");
+  template <auto F> static Function make(std::string name) {
+    using Sig = HostSignature<decltype(F)>;
+    auto callback = [](ExtismCurrentPlugin *p, const ExtismVal *inputs,
+                       ExtismSize nInputs, ExtismVal *outputs,
+                       ExtismSize nOutputs, void *data) {
+      invoke<Sig>(*F, *static_cast<const std::string *>(data), p, inputs,
+                  nInputs, outputs, nOutputs,
+                  std::make_index_sequence<
+                      std::tuple_size_v<typename Sig::Params>>());
+    };
+    auto data = new std::string(name);
+    return makeWith<Sig>(
+        std::move(name), callback, data,
+        [](void *data) { delete static_cast<std::string *>(data); });
+  }
+
+  // Create a host function from a lambda or other callable, the Wasm
+  // signature is derived from its parameter and return types:
+  //   Function::make("greet", [](std::string_view name) {
+  //     return "Hello, " + std::string(name);
+  //   });
+  template <typename F> static Function make(std::string name, F f) {
+    using Fn = std::decay_t<F>;
+    using Sig = HostSignature<decltype(&Fn::operator())>;
+    auto callback = [](ExtismCurrentPlugin *p, const ExtismVal *inputs,
+                       ExtismSize nInputs, ExtismVal *outputs,
+                       ExtismSize nOutputs, void *data) {
+      auto bound = static_cast<Bound<Fn> *>(data);
+      invoke<Sig>(bound->f, bound->name, p, inputs, nInputs, outputs,
+                  nOutputs,
+                  std::make_index_sequence<
+                      std::tuple_size_v<typename Sig::Params>>());
+    };
+    auto data = new Bound<Fn>{name, std::move(f)};
+    return makeWith<Sig>(
+        std::move(name), callback, data,
+        [](void *data) { delete static_cast<Bound<Fn> *>(data); });
+  }
+
+  // The user data is held by the ExtismFunction, so copies of a Function
+  // can be passed to any number of plugins and outlive the original
   Function(std::string name, const std::vector<ValType> &inputs,
            const std::vector<ValType> &outputs, FunctionType f,
            void *userData = NULL, std::function<void(void *)> free = nullptr);
@@ -246,14 +969,311 @@ public:
   ExtismFunction *get() const;
 };
 
+// A set of host functions built once and shared by any number of plugins,
+// compiled plugins and pools. The user data of functions added with a
+// FunctionType is kept in an arena owned by the table, at addresses that
+// never change, and is freed when the table and every function copied from
+// it are gone. Adding functions isn't thread-safe, using the table is:
+//   HostFunctionTable table;
+//   table.add("hello_world", {ExtismValType_I64}, {ExtismValType_I64}, f);
+//   PluginPool pool(manifest, true, table.functions());
+class HostFunctionTable {
+  struct Arena;
+  std::shared_ptr<Arena> arena;
+  std::vector<Function> entries;
+
+public:
+  HostFunctionTable();
+
+  // Add a host function, like the Function constructor
+  HostFunctionTable &add(std::string name, const std::vector<ValType> &inputs,
+                         const std::vector<ValType> &outputs, FunctionType f,
+                         void *userData = NULL,
+                         std::function<void(void *)> free = nullptr);
+
+  // Add a host function in namespace `ns`
+  HostFunctionTable &add(const std::string &ns, std::string name,
+                         const std::vector<ValType> &inputs,
+                         const std::vector<ValType> &outputs, FunctionType f,
+                         void *userData = NULL,
+                         std::function<void(void *)> free = nullptr);
+
+  // Add a function made elsewhere, for example with Function::make
+  HostFunctionTable &add(Function f);
+
+  // The functions, for the Plugin, CompiledPlugin and PluginPool
+  // constructors. Copying them only copies references
+  const std::vector<Function> &functions() const { return entries; }
+
+  size_t size() const { return entries.size(); }
+};
+
+// Input of Plugin::callStream
+class StreamSource {
+public:
+  virtual ~StreamSource() = default;
+  // Read up to `len` bytes into `buf`, waiting until at least one is
+  // available. Returns 0 at the end of the input
+  virtual size_t read(uint8_t *buf, size_t len) = 0;
+};
+
+// Output of Plugin::callStream
+class StreamSink {
+public:
+  virtual ~StreamSink() = default;
+  // Write all `len` bytes
+  virtual void write(const uint8_t *data, size_t len) = 0;
+};
+
+// Reads from a std::istream, which must outlive it
+class IstreamSource : public StreamSource {
+  std::istream &in;
+
+public:
+  explicit IstreamSource(std::istream &in) : in(in) {}
+  size_t read(uint8_t *buf, size_t len) override;
+};
+
+// Writes to a std::ostream, which must outlive it
+class OstreamSink : public StreamSink {
+  std::ostream &out;
+
+public:
+  explicit OstreamSink(std::ostream &out) : out(out) {}
+  void write(const uint8_t *data, size_t len) override;
+};
+
+// Reads from a file descriptor, which is not closed
+class FdSource : public StreamSource {
+  int fd;
+
+public:
+  explicit FdSource(int fd) : fd(fd) {}
+  size_t read(uint8_t *buf, size_t len) override;
+};
+
+// Writes to a file descriptor, which is not closed
+class FdSink : public StreamSink {
+  int fd;
+
+public:
+  explicit FdSink(int fd) : fd(fd) {}
+  void write(const uint8_t *data, size_t len) override;
+};
+
+// The host functions used by Plugin::callStream, pass them to the
+// constructor of plug-ins that stream. In the default namespace:
+//   stream_read() -> i64: a memory block with the next chunk of input, or 0
+//     at the end of the input. The guest frees it
+//   stream_write(i64): write a memory block to the output. The guest still
+//     owns the block
+std::vector<Function> streamFunctions();
+
+// A work-stealing thread pool used to run asynchronous plugin calls
+class Executor {
+  struct Impl;
+  std::unique_ptr<Impl> impl;
+
+public:
+  // Start `threads` worker threads, 0 means one per hardware thread
+  explicit Executor(size_t threads = 0);
+  ~Executor();
+
+  Executor(const Executor &) = delete;
+  Executor &operator=(const Executor &) = delete;
+
+  // Queue a task, tasks queued from a worker thread run on that worker
+  // unless another worker steals them
+  void submit(std::function<void()> task);
+
+  // Number of worker threads
+  size_t threads() const;
+
+  // The executor owned by the library, used when no executor is given to
+  // callAsync. It is started on first use
+  static Executor &shared();
+
+  // Set the number of worker threads of the shared executor, throws if it
+  // has already been started
+  static void configureShared(size_t threads);
+};
+
+// The result of an asynchronous call, the output is owned by the future
+class CallFuture {
+public:
+  struct State {
+    std::promise<std::vector<uint8_t>> promise;
+    std::mutex mutex;
+    bool cancelled = false;
+    // Set while the call is running
+    const ExtismCancelHandle *handle = nullptr;
+    // Set once cancel has been called on a running call, removes the timer
+    // that cancels it when released
+    std::shared_ptr<void> canceller;
+
+    // Publish the cancel handle of the call about to run, throws if the
+    // call has already been cancelled
+    void start(const ExtismCancelHandle *handle);
+    // Clear the handle once the call has returned
+    void finish();
+  };
+
+private:
+  std::shared_ptr<State> state;
+  std::future<std::vector<uint8_t>> future;
+
+public:
+  CallFuture(std::shared_ptr<State> state);
+
+  // Wait for the call to finish and take its output, rethrows any error
+  std::vector<uint8_t> get();
+
+  // Wait for the call to finish
+  void wait() const;
+
+  // Returns true if the call has finished
+  bool ready() const;
+
+  // Cancel the call, if it is running it is interrupted using its plugin's
+  // CancelHandle. Returns false if the call had already finished
+  bool cancel();
+};
+
+typedef std::function<void(std::vector<uint8_t> output,
+                           std::exception_ptr error)>
+    CallCallback;
+
+class Plugin;
+
+// A module that has been parsed and compiled once, and can be instantiated
+// many times without recompiling. Instantiating is thread-safe.
+class CompiledPlugin {
+  // Shared with the plugins instantiated from it
+  std::shared_ptr<const std::vector<Function>> functions;
+  std::shared_ptr<ExtismCompiledPlugin> compiled;
+
+  friend class Plugin;
+
+public:
+  // Compile a plugin
+  CompiledPlugin(const uint8_t *wasm, size_t length, bool withWasi = false,
+                 std::vector<Function> functions = std::vector<Function>());
+
+  CompiledPlugin(std::string_view str, bool withWasi = false,
+                 std::vector<Function> functions = {});
+
+  CompiledPlugin(const std::vector<uint8_t> &data, bool withWasi = false,
+                 std::vector<Function> functions = {});
+
+  // Compile a plugin from Manifest. Throws if the manifest has a fuel
+  // limit, which compiled plugins don't support
+  CompiledPlugin(const Manifest &manifest, bool withWasi = false,
+                 std::vector<Function> functions = {});
+
+  // Create a new plugin instance from the compiled module
+  Plugin instantiate() const;
+
+  // Get a ptr to the compiled plugin that can be passed to the c api
+  ExtismCompiledPlugin *get() const { return compiled.get(); }
+};
+
+// Distribution of call durations in nanoseconds. Like HdrHistogram, each
+// power of two is split into `subBuckets` linear buckets, so values are
+// recorded with a relative error of at most 1/subBuckets
+struct LatencyHistogram {
+  static constexpr size_t subBuckets = 8;
+  static constexpr size_t bucketCount = 62 * subBuckets;
+
+  std::vector<uint64_t> counts = std::vector<uint64_t>(bucketCount);
+  uint64_t count = 0;
+  uint64_t sum = 0;
+
+  // Index of the bucket holding `value`
+  static size_t bucket(uint64_t value);
+  // Smallest value recorded in bucket `index`
+  static uint64_t bucketLowerBound(size_t index);
+
+  // Upper bound of the value below which a fraction `q` of the recorded
+  // values fall, 0 when nothing has been recorded
+  uint64_t quantile(double q) const;
+  void merge(const LatencyHistogram &other);
+};
+
+// Totals for one export or host function
+struct CallStats {
+  uint64_t calls = 0;
+  uint64_t errors = 0;
+  uint64_t inputBytes = 0;
+  uint64_t outputBytes = 0;
+  LatencyHistogram latency;
+
+  void merge(const CallStats &other);
+};
+
+// Metrics recorded by a plugin, keyed by export and host function name.
+// Host functions don't record byte counts
+struct MetricsSnapshot {
+  std::map<std::string, CallStats> exports;
+  std::map<std::string, CallStats> hostFunctions;
+
+  void merge(const MetricsSnapshot &other);
+};
+
+// Format `metrics` in the Prometheus text exposition format. `labels` are
+// added to every sample, for example `plugin="resize"`
+std::string prometheusText(const MetricsSnapshot &metrics,
+                           std::string_view labels = "");
+
+#ifdef EXTISM_CPP_METRICS
+class PluginMetrics;
+#endif
+
 class Plugin {
-  std::vector<Function> functions;
+  std::shared_ptr<const std::vector<Function>> functions;
+  std::shared_ptr<ExtismCompiledPlugin> compiled;
 
   struct PluginDeleter {
     void operator()(ExtismPlugin *) const;
   };
   using unique_plugin = std::unique_ptr<ExtismPlugin, PluginDeleter>;
   unique_plugin plugin;
+  std::optional<uint64_t> fuel;
+  // Asynchronous calls waiting their turn, run one at a time so each call's
+  // output can be copied out before the next one starts
+  struct AsyncQueue;
+  static std::shared_ptr<AsyncQueue> newAsyncQueue();
+  std::shared_ptr<AsyncQueue> asyncQueue = newAsyncQueue();
+
+#ifdef EXTISM_CPP_CHECK_BUFFERS
+  // Incremented by anything that invalidates the output of the last call
+  std::shared_ptr<std::atomic<uint64_t>> generation =
+      std::make_shared<std::atomic<uint64_t>>(0);
+#endif
+
+#ifdef EXTISM_CPP_METRICS
+  static std::shared_ptr<PluginMetrics> newMetrics();
+  std::shared_ptr<PluginMetrics> metricsData = newMetrics();
+#endif
+
+  // Mark Buffers pointing into plugin memory as invalid
+  void invalidateBuffers() const {
+#ifdef EXTISM_CPP_CHECK_BUFFERS
+    generation->fetch_add(1);
+#endif
+  }
+
+  // Run a call leaving its output in plugin memory, throws on error
+  void callRaw(const char *func, const uint8_t *input, size_t inputLength,
+               std::optional<Deadline> deadline = std::nullopt,
+               void *hostContext = nullptr) const;
+
+  std::vector<uint8_t> asyncCall(const std::string &func,
+                                 const std::vector<uint8_t> &input,
+                                 CallFuture::State *state) const;
+  void enqueueAsync(std::function<void()> call, Executor &executor) const;
+
+  friend class PluginPool;
+  friend class Pipeline;
 
 public:
   class CancelHandle {
@@ -265,23 +1285,34 @@ public:
   };
 
   // Create a new plugin
+  // With `fuelLimit` each call may use at most that much fuel, roughly the
+  // number of Wasm instructions, and throws FuelExhausted when it runs out
   Plugin(const uint8_t *wasm, size_t length, bool withWasi = false,
-         std::vector<Function> functions = std::vector<Function>());
+         std::vector<Function> functions = std::vector<Function>(),
+         std::optional<uint64_t> fuelLimit = std::nullopt);
 
   Plugin(std::string_view str, bool withWasi = false,
-         std::vector<Function> functions = {});
+         std::vector<Function> functions = {},
+         std::optional<uint64_t> fuelLimit = std::nullopt);
 
   Plugin(const std::vector<uint8_t> &data, bool withWasi = false,
-         std::vector<Function> functions = {});
+         std::vector<Function> functions = {},
+         std::optional<uint64_t> fuelLimit = std::nullopt);
+
+  // Create a new plugin from an already compiled module
+  Plugin(const CompiledPlugin &compiled);
 
   CancelHandle cancelHandle();
 
-  // Create a new plugin from Manifest
+  // Create a new plugin from Manifest, using its fuel limit if it has one
   Plugin(const Manifest &manifest, bool withWasi = false,
          std::vector<Function> functions = {});
 
   void config(const Config &data);
 
+  // Apply pre-serialized config updates
+  void config(const ConfigBlob &blob);
+
   void config(const char *json, size_t length);
 
   void config(std::string_view json);
@@ -295,6 +1326,54 @@ public:
   // Call a plugin function with string input
   Buffer call(const char *func, std::string_view input = "") const;
 
+  // Call a plugin, cancelling the call if it is still running at
+  // `deadline`. Throws TimeoutError if it was cancelled, other failures
+  // throw Error as usual
+  Buffer call(const char *func, const uint8_t *input, size_t inputLength,
+              Deadline deadline) const;
+
+  // Call a plugin function with std::vector<uint8_t> input and a deadline
+  Buffer call(const char *func, const std::vector<uint8_t> &input,
+              Deadline deadline) const;
+
+  // Call a plugin function with string input and a deadline
+  Buffer call(const char *func, std::string_view input,
+              Deadline deadline) const;
+
+  // Call a plugin function with string input and a deadline
+  Buffer call(const std::string &func, std::string_view input,
+              Deadline deadline) const;
+
+  // Call a plugin with a context for this call only, which host functions
+  // read with CurrentPlugin::hostContext. Calls on different plugins can
+  // share host functions and pass each their own context
+  Buffer call(const char *func, const uint8_t *input, size_t inputLength,
+              void *hostContext) const;
+
+  // Call a plugin function with std::vector<uint8_t> input and a host
+  // context
+  Buffer call(const char *func, const std::vector<uint8_t> &input,
+              void *hostContext) const;
+
+  // Call a plugin function with string input and a host context
+  Buffer call(const char *func, std::string_view input,
+              void *hostContext) const;
+
+  // Call a plugin function with string input and a host context
+  Buffer call(const std::string &func, std::string_view input,
+              void *hostContext) const;
+
+  // Call a plugin that reads its input with stream_read and writes its
+  // output with stream_write, see streamFunctions. The input is read in
+  // chunks of at most `chunkSize` bytes, and the host holds one chunk at a
+  // time. An error from the source or sink ends the input, and is thrown
+  // once the call returns. Returns the output set by the export, if any
+  Buffer callStream(const char *func, StreamSource &source, StreamSink &sink,
+                    size_t chunkSize = 64 * 1024) const;
+
+  Buffer callStream(const std::string &func, StreamSource &source,
+                    StreamSink &sink, size_t chunkSize = 64 * 1024) const;
+
   // Call a plugin
   Buffer call(const std::string &func, const uint8_t *input,
               size_t inputLength) const;
@@ -305,6 +1384,63 @@ public:
   // Call a plugin function with string input
   Buffer call(const std::string &func, std::string_view input = "") const;
 
+  // Call a plugin and copy the output into an OwnedBuffer
+  OwnedBuffer callOwned(const char *func, const uint8_t *input,
+                        size_t inputLength) const;
+
+  // Call a plugin function with string input and copy the output into an
+  // OwnedBuffer
+  OwnedBuffer callOwned(const char *func, std::string_view input = "") const;
+
+  // Call a plugin function with string input and copy the output into an
+  // OwnedBuffer
+  OwnedBuffer callOwned(const std::string &func,
+                        std::string_view input = "") const;
+
+  // Call a plugin and copy the output into `out`, which must be at least
+  // `outLength` bytes. Returns the length of the output, if that is larger
+  // than `outLength` nothing is copied
+  size_t callInto(const char *func, const uint8_t *input, size_t inputLength,
+                  uint8_t *out, size_t outLength) const;
+
+  // Call a plugin function with string input and copy the output into `out`
+  size_t callInto(const char *func, std::string_view input, uint8_t *out,
+                  size_t outLength) const;
+
+  // Call a plugin function with string input and replace the contents of
+  // `out` with the output, reusing its capacity
+  void callInto(const char *func, std::string_view input,
+                std::vector<uint8_t> &out) const;
+
+  // Call a plugin function once for each input, the outputs are copied into
+  // a single buffer. Failed calls are recorded without stopping the batch.
+  // If `resetEvery` is non-zero the plugin is reset after that many calls
+  BatchResult callBatch(const char *func, const std::string_view *inputs,
+                        size_t count, size_t resetEvery = 0) const;
+
+  // Call a plugin function once for each input
+  BatchResult callBatch(const char *func,
+                        const std::vector<std::string_view> &inputs,
+                        size_t resetEvery = 0) const;
+
+  // Call a plugin function once for each input
+  BatchResult callBatch(const std::string &func,
+                        const std::vector<std::string_view> &inputs,
+                        size_t resetEvery = 0) const;
+
+  // Call a plugin function on `executor`, the plugin must outlive the call
+  CallFuture callAsync(std::string func, std::vector<uint8_t> input,
+                       Executor &executor = Executor::shared()) const;
+
+  // Call a plugin function with string input on `executor`
+  CallFuture callAsync(std::string func, std::string_view input = "",
+                       Executor &executor = Executor::shared()) const;
+
+  // Call a plugin function on `executor` and pass the result to `callback`
+  void callAsync(std::string func, std::vector<uint8_t> input,
+                 CallCallback callback,
+                 Executor &executor = Executor::shared()) const;
+
   // Returns true if the specified function exists
   bool functionExists(const char *func) const;
 
@@ -315,13 +1451,295 @@ public:
   // returns true if it succeeded
   bool reset() const;
 
+  // The fuel each call may use, if limited
+  std::optional<uint64_t> fuelLimit() const { return fuel; }
+
+  // Calls made by this plugin and its host functions so far. Always empty
+  // unless the library is built with EXTISM_CPP_METRICS
+  MetricsSnapshot metrics() const;
+
   // Get a ptr to the plugin that can be passed to the c api
   ExtismPlugin *get() const { return plugin.get(); }
 };
 
+// A thread-safe set of plugin instances created from a single compiled
+// module. Instances are checked out for the duration of a call, so threads
+// don't serialize on one shared plugin.
+class PluginPool {
+  struct State;
+  std::shared_ptr<State> state;
+
+  friend class Pipeline;
+
+public:
+  // An instance checked out of a pool, it is returned when the handle is
+  // destroyed
+  class Handle {
+    std::shared_ptr<State> state;
+    std::unique_ptr<Plugin> plugin;
+
+    friend class PluginPool;
+    Handle(std::shared_ptr<State> state, std::unique_ptr<Plugin> plugin);
+    void release();
+
+  public:
+    Handle(Handle &&h) = default;
+    Handle &operator=(Handle &&h);
+    ~Handle();
+
+    Plugin &operator*() const { return *plugin; }
+    Plugin *operator->() const { return plugin.get(); }
+
+    // Call a function on the checked out plugin, accepts the same arguments
+    // as Plugin::call
+    template <typename... Args> Buffer call(Args &&...args) const {
+      return plugin->call(std::forward<Args>(args)...);
+    }
+  };
+
+  // Create a pool that grows up to `maxSize` instances, `maxSize` of 0 means
+  // one per hardware thread
+  PluginPool(CompiledPlugin compiled, size_t maxSize = 0);
+
+  // Create a pool from Manifest
+  PluginPool(const Manifest &manifest, bool withWasi = false,
+             std::vector<Function> functions = {}, size_t maxSize = 0);
+
+  // Check out an instance, blocking while all `maxSize` instances are in use
+  Handle acquire() const;
+
+  // Check out an instance without blocking, returns std::nullopt if all
+  // `maxSize` instances are in use
+  std::optional<Handle> tryAcquire() const;
+
+  // Free idle instances until at most `size` remain
+  void shrink(size_t size = 0) const;
+
+  // Run `warmUp` on every instance the pool creates from now on, before it
+  // is checked out. Returned instances aren't reset, so state that `warmUp`
+  // builds, like tables in linear memory, lasts for the life of the instance
+  // instead of being rebuilt by every caller. If it throws, creating the
+  // instance fails
+  void setWarmUp(std::function<void(Plugin &)> warmUp) const;
+
+  // Create and warm up instances until `count` are idle or the pool is
+  // full, to take creation and warm-up off the path of the first calls
+  void prewarm(size_t count) const;
+
+  // Call a plugin function on `executor` using the next available instance
+  CallFuture callAsync(std::string func, std::vector<uint8_t> input,
+                       Executor &executor = Executor::shared()) const;
+
+  // Call a plugin function with string input on `executor`
+  CallFuture callAsync(std::string func, std::string_view input = "",
+                       Executor &executor = Executor::shared()) const;
+
+  // Call a plugin function on `executor` and pass the result to `callback`
+  void callAsync(std::string func, std::vector<uint8_t> input,
+                 CallCallback callback,
+                 Executor &executor = Executor::shared()) const;
+
+  // Change the maximum number of instances, instances above the new limit
+  // are freed as they become idle
+  void setMaxSize(size_t maxSize) const;
+
+  // Number of live instances, including those checked out
+  size_t size() const;
+
+  // Number of idle instances
+  size_t idle() const;
+
+private:
+  // Run `call` on `executor` once an instance is free. While all are in use
+  // it waits in the pool rather than holding a worker. `call` checks out
+  // the instance with the function it is given, which throws if creating
+  // the instance fails
+  void whenAvailable(
+      std::function<void(const std::function<Handle()> &)> call,
+      Executor &executor) const;
+};
+
+// Runs requests through a sequence of stages, each calling an export of a
+// plug-in or of instances from a pool, with the output of each stage as the
+// input of the next. Outputs are passed on as Buffers in the memory of the
+// instance that produced them, which is held until the next stage has
+// copied them in. Every stage has its own worker threads and a bounded
+// queue, so stages of different requests run at the same time:
+//   auto pipeline = Pipeline::Builder()
+//                       .stage(decoder, "decode")
+//                       .stage(transformers, "transform", 4)
+//                       .stage(encoder, "encode")
+//                       .build();
+//   CallFuture result = pipeline.submit(input);
+class Pipeline {
+public:
+  struct StageStats {
+    std::string func;
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t inputBytes;
+    uint64_t outputBytes;
+    // Time spent in calls, summed over the stage's workers
+    std::chrono::nanoseconds busy;
+    // Requests waiting in the stage's queue
+    size_t queued;
+    // Calls per second since the pipeline started
+    double throughput;
+  };
+
+  class Builder {
+    struct Stage {
+      Plugin *plugin;
+      std::optional<PluginPool> pool;
+      std::string func;
+      size_t concurrency;
+    };
+    std::vector<Stage> stages;
+    size_t queueCapacity = 4;
+
+    friend class Pipeline;
+
+  public:
+    // Call `func` on `plugin`, which must outlive the pipeline and not be
+    // called elsewhere while it runs. A plug-in holds one output at a time,
+    // so it can't start the next request until the following stage has
+    // taken its input
+    Builder &stage(Plugin &plugin, std::string func);
+
+    // Call `func` on instances from `pool`, up to `concurrency` at a time.
+    // Each output holds its instance until the following stage has taken it
+    Builder &stage(const PluginPool &pool, std::string func,
+                   size_t concurrency = 1);
+
+    // Requests each stage can queue, submit blocks while the first stage's
+    // queue is full
+    Builder &queueSize(size_t size);
+
+    // Start the workers, throws if there are no stages or a plug-in or pool
+    // is used by more than one stage
+    Pipeline build();
+  };
+
+  Pipeline(Pipeline &&);
+  Pipeline &operator=(Pipeline &&);
+  // Finishes every submitted request before returning
+  ~Pipeline();
+
+  // Run a request through every stage, the output of the last stage is
+  // owned by the future
+  CallFuture submit(std::vector<uint8_t> input) const;
+
+  // Run a request with string input
+  CallFuture submit(std::string_view input) const;
+
+  // Run a request and pass the output of the last stage to `callback`, on
+  // the last stage's worker thread
+  void submit(std::vector<uint8_t> input, CallCallback callback) const;
+
+  std::vector<StageStats> stats() const;
+
+private:
+  struct Impl;
+  std::unique_ptr<Impl> impl;
+
+  explicit Pipeline(std::unique_ptr<Impl> impl);
+};
+
+// The current version of a plug-in, as a pool, which can be replaced while
+// it is being called. Each call takes a reference to the version that is
+// current when it starts and finishes on it, so reload never waits for
+// calls and calls never wait for reload, beyond copying a pointer. A
+// replaced version is freed, with its instances, once its last call ends:
+//   PluginHandle handle(Manifest::wasmPath("v1.wasm"));
+//   handle.call("run", input);
+//   handle.reload(Manifest::wasmPath("v2.wasm"));
+class PluginHandle {
+  struct Version {
+    PluginPool pool;
+    uint64_t number;
+  };
+  // Only read and written with std::atomic_load and std::atomic_store
+  std::shared_ptr<const Version> current;
+  // Serializes reloads, so version numbers are published in order
+  std::unique_ptr<std::mutex> reloading = std::make_unique<std::mutex>();
+  // How reload(const Manifest &) creates a pool, unset if the handle
+  // started with a pool
+  struct Options {
+    bool withWasi;
+    std::vector<Function> functions;
+    size_t maxSize;
+  };
+  const std::optional<Options> options;
+
+  std::shared_ptr<const Version> load() const;
+
+public:
+  // Start with a pool created from `manifest`. Reloading from a manifest
+  // uses the same WASI setting, host functions and pool size
+  PluginHandle(const Manifest &manifest, bool withWasi = false,
+               std::vector<Function> functions = {}, size_t maxSize = 0);
+
+  // Start with an existing pool. Its WASI setting and host functions aren't
+  // known, so it can only be reloaded with a pool
+  explicit PluginHandle(PluginPool pool);
+
+  // Compile `manifest` and publish it as the new version, returns its
+  // number. Compiling happens before the swap, calls keep running on the
+  // current version meanwhile. Throws if the handle started with a pool
+  uint64_t reload(const Manifest &manifest);
+
+  // Publish a pool, which may already be warmed up, as the new version
+  uint64_t reload(PluginPool pool);
+
+  // Call `func` on an instance of the current version, the output is
+  // copied out before the instance is returned to its pool
+  OwnedBuffer call(const char *func, const uint8_t *input,
+                   size_t inputLength) const;
+
+  OwnedBuffer call(const char *func, std::string_view input = "") const;
+
+  OwnedBuffer call(const std::string &func, std::string_view input = "") const;
+
+  // Check out an instance of the current version for several calls, it
+  // keeps its version alive until it is returned
+  PluginPool::Handle acquire() const;
+
+  // The current version's pool
+  PluginPool pool() const;
+
+  // Number of the current version, starting at 1
+  uint64_t version() const;
+};
+
 // Set global log file for plugins
-inline bool setLogFile(const char *filename, const char *level);
+bool setLogFile(const char *filename, const char *level);
+
+// Receives libextism's log lines in batches, on a background thread
+typedef std::function<void(const std::vector<std::string> &lines)>
+    LogCallback;
+
+// Send log lines at `level` and above to `callback` instead of a file. The
+// lines are buffered and delivered off the calling threads, when the buffer
+// is full new lines are dropped. libextism's logger can only be installed
+// once, later calls only replace the callback and ignore `level`. Passing
+// nullptr stops collecting, lines logged meanwhile stay in libextism until
+// a callback is set again or flushLogs drops them. Returns false if a log
+// file is already set or `level` is invalid
+bool setLogCallback(const char *level, LogCallback callback);
+
+// Deliver every line logged so far before returning. Called from the
+// callback, the lines are delivered once it returns
+void flushLogs();
+
+struct LogStats {
+  // Lines received from libextism
+  uint64_t lines;
+  // Lines dropped because the callback fell behind
+  uint64_t dropped;
+};
+
+LogStats logStats();
 
 // Get libextism version
-inline std::string_view version();
+std::string_view version();
 } // namespace extism
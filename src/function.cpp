@@ -1,32 +1,56 @@
 #include "extism.hpp"
 
+#include <deque>
+
 namespace extism {
 static void functionCallback(ExtismCurrentPlugin *plugin,
                              const ExtismVal *inputs, ExtismSize n_inputs,
                              ExtismVal *outputs, ExtismSize n_outputs,
                              void *user_data) {
   Function::UserData *data = static_cast<Function::UserData *>(user_data);
+#ifdef EXTISM_CPP_METRICS
+  HostCallMetrics metrics(data->name);
+#endif
+  TraceSpan trace(Span::Kind::HostFunction, data->name);
   data->func(CurrentPlugin(plugin, inputs, n_inputs, outputs, n_outputs),
              data->userData);
+#ifdef EXTISM_CPP_METRICS
+  metrics.succeeded();
+#endif
 }
 
-static void freeUserData(void *user_data) {
-  Function::UserData *data = static_cast<Function::UserData *>(user_data);
+static void freeUserData(Function::UserData *data) {
   if (data->userData != nullptr && data->freeUserData != nullptr) {
     data->freeUserData(data->userData);
   }
 }
 
+// Called by libextism once the function and every plugin using it are gone
+static void deleteUserData(void *user_data) {
+  Function::UserData *data = static_cast<Function::UserData *>(user_data);
+  freeUserData(data);
+  delete data;
+}
+
 Function::Function(std::string name, const std::vector<ValType> &inputs,
                    const std::vector<ValType> &outputs, FunctionType f,
                    void *userData, std::function<void(void *)> free)
     : name(std::move(name)) {
-  this->userData.func = f;
-  this->userData.userData = userData;
-  this->userData.freeUserData = free;
-  auto ptr = extism_function_new(
-      this->name.c_str(), inputs.data(), inputs.size(), outputs.data(),
-      outputs.size(), functionCallback, &this->userData, freeUserData);
+  auto data = new UserData{f, userData, std::move(free), this->name};
+  auto ptr = extism_function_new(this->name.c_str(), inputs.data(),
+                                 inputs.size(), outputs.data(), outputs.size(),
+                                 functionCallback, data, deleteUserData);
+  this->func = std::shared_ptr<ExtismFunction>(ptr, extism_function_free);
+}
+
+Function::Function(std::string name, const std::vector<ValType> &inputs,
+                   const std::vector<ValType> &outputs,
+                   ExtismFunctionType callback, void *userData,
+                   void (*free)(void *))
+    : name(std::move(name)) {
+  auto ptr = extism_function_new(this->name.c_str(), inputs.data(),
+                                 inputs.size(), outputs.data(), outputs.size(),
+                                 callback, userData, free);
   this->func = std::shared_ptr<ExtismFunction>(ptr, extism_function_free);
 }
 
@@ -42,7 +66,49 @@ void Function::setNamespace(const std::string &s) const {
   extism_function_set_namespace(this->func.get(), s.c_str());
 }
 
-Function::Function(const Function &f) { this->func = f.func; }
+Function::Function(const Function &f) = default;
+
+// User data of the functions of a HostFunctionTable. A deque never moves
+// its elements, so their addresses stay valid as functions are added
+struct HostFunctionTable::Arena {
+  std::deque<Function::UserData> entries;
+
+  ~Arena() {
+    for (auto &data : entries) {
+      freeUserData(&data);
+    }
+  }
+};
+
+HostFunctionTable::HostFunctionTable() : arena(std::make_shared<Arena>()) {}
+
+HostFunctionTable &
+HostFunctionTable::add(std::string name, const std::vector<ValType> &inputs,
+                       const std::vector<ValType> &outputs, FunctionType f,
+                       void *userData, std::function<void(void *)> free) {
+  auto &data = this->arena->entries.emplace_back(
+      Function::UserData{f, userData, std::move(free), name});
+  Function function(std::move(name), inputs, outputs, functionCallback, &data,
+                    nullptr);
+  function.owner = this->arena;
+  this->entries.push_back(std::move(function));
+  return *this;
+}
+
+HostFunctionTable &
+HostFunctionTable::add(const std::string &ns, std::string name,
+                       const std::vector<ValType> &inputs,
+                       const std::vector<ValType> &outputs, FunctionType f,
+                       void *userData, std::function<void(void *)> free) {
+  this->add(std::move(name), inputs, outputs, f, userData, std::move(free));
+  this->entries.back().setNamespace(ns);
+  return *this;
+}
+
+HostFunctionTable &HostFunctionTable::add(Function f) {
+  this->entries.push_back(std::move(f));
+  return *this;
+}
 
 ExtismFunction *Function::get() const { return this->func.get(); }
 
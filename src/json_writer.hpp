@@ -0,0 +1,191 @@
+#pragma once
+
+#include "base64.hpp"
+#include "extism.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <string>
+#include <string_view>
+
+namespace extism {
+
+// Writes JSON text straight into a string or a JsonSink, without building a
+// document first. The output matches Json::FastWriter, including its
+// escaping of non-ASCII characters as \u sequences
+class JsonWriter {
+  std::string buffer;
+  std::string &out;
+  const JsonSink *sink = nullptr;
+
+  // Size at which buffered output is passed to the sink
+  static const size_t flushSize = 64 * 1024;
+  // Bytes of binary data encoded per chunk when writing to a sink, a
+  // multiple of 3 so there is no padding between chunks
+  static const size_t base64ChunkSize = 48 * 1024;
+
+  void appendEscaped(unsigned int c) {
+    static const char hex[] = "0123456789abcdef";
+    const char escaped[] = {'\\',
+                            'u',
+                            hex[(c >> 12) & 0xf],
+                            hex[(c >> 8) & 0xf],
+                            hex[(c >> 4) & 0xf],
+                            hex[c & 0xf]};
+    out.append(escaped, sizeof(escaped));
+  }
+
+  // Decode one UTF-8 sequence starting at `s` the way jsoncpp does, leaving
+  // `s` on its last byte. Invalid sequences decode to U+FFFD
+  static unsigned int codepoint(const char *&s, const char *end) {
+    const unsigned int replacement = 0xfffd;
+    const unsigned int first = static_cast<unsigned char>(*s);
+    if (first < 0x80) {
+      return first;
+    }
+    if (first < 0xe0) {
+      if (end - s < 2) {
+        return replacement;
+      }
+      const unsigned int c = ((first & 0x1f) << 6) | (s[1] & 0x3f);
+      s += 1;
+      return c < 0x80 ? replacement : c;
+    }
+    if (first < 0xf0) {
+      if (end - s < 3) {
+        return replacement;
+      }
+      const unsigned int c =
+          ((first & 0x0f) << 12) | ((s[1] & 0x3f) << 6) | (s[2] & 0x3f);
+      s += 2;
+      if (c >= 0xd800 && c <= 0xdfff) {
+        return replacement;
+      }
+      return c < 0x800 ? replacement : c;
+    }
+    if (first < 0xf8) {
+      if (end - s < 4) {
+        return replacement;
+      }
+      const unsigned int c = ((first & 0x07) << 18) | ((s[1] & 0x3f) << 12) |
+                             ((s[2] & 0x3f) << 6) | (s[3] & 0x3f);
+      s += 3;
+      return c < 0x10000 ? replacement : c;
+    }
+    return replacement;
+  }
+
+  void maybeFlush() {
+    if (sink != nullptr && buffer.size() >= flushSize) {
+      flush();
+    }
+  }
+
+public:
+  // Write into `out`
+  explicit JsonWriter(std::string &out) : out(out) {}
+
+  // Write into `sink` in chunks, call flush() when done
+  explicit JsonWriter(const JsonSink &sink) : out(buffer), sink(&sink) {
+    buffer.reserve(flushSize + base64ChunkSize / 3 * 4);
+  }
+
+  // Reserve room for `n` more bytes, ignored when writing to a sink
+  void reserve(size_t n) {
+    if (sink == nullptr) {
+      out.reserve(out.size() + n);
+    }
+  }
+
+  // Pass any buffered output to the sink
+  void flush() {
+    if (sink != nullptr && !buffer.empty()) {
+      (*sink)(buffer);
+      buffer.clear();
+    }
+  }
+
+  void raw(char c) { out.push_back(c); }
+
+  void raw(std::string_view s) {
+    out.append(s);
+    maybeFlush();
+  }
+
+  // Write a quoted and escaped string
+  void string(std::string_view s) {
+    out.push_back('"');
+    const char *end = s.data() + s.size();
+    for (const char *c = s.data(); c != end; ++c) {
+      const unsigned char ch = static_cast<unsigned char>(*c);
+      switch (ch) {
+      case '"':
+        out.append("\\\"");
+        break;
+      case '\\':
+        out.append("\\\\");
+        break;
+      case '\b':
+        out.append("\\b");
+        break;
+      case '\f':
+        out.append("\\f");
+        break;
+      case '\n':
+        out.append("\\n");
+        break;
+      case '\r':
+        out.append("\\r");
+        break;
+      case '\t':
+        out.append("\\t");
+        break;
+      default:
+        if (ch >= 0x20 && ch < 0x80) {
+          out.push_back(*c);
+        } else {
+          unsigned int cp = codepoint(c, end);
+          if (cp < 0x10000) {
+            appendEscaped(cp);
+          } else {
+            cp -= 0x10000;
+            appendEscaped(0xd800 + ((cp >> 10) & 0x3ff));
+            appendEscaped(0xdc00 + (cp & 0x3ff));
+          }
+        }
+      }
+    }
+    out.push_back('"');
+    maybeFlush();
+  }
+
+  // Write an object key and the following colon
+  void key(std::string_view k) {
+    string(k);
+    out.push_back(':');
+  }
+
+  void number(uint64_t n) {
+    char digits[20];
+    auto res = std::to_chars(digits, digits + sizeof(digits), n);
+    out.append(digits, res.ptr - digits);
+  }
+
+  // Write binary data as a quoted base64 string
+  void base64(const uint8_t *data, size_t len) {
+    out.push_back('"');
+    const size_t chunk = sink == nullptr ? len : base64ChunkSize;
+    do {
+      const size_t n = std::min(len, chunk);
+      const size_t at = out.size();
+      out.resize(at + base64_encoded_length(n));
+      base64_encode(data, n, &out[at]);
+      data += n;
+      len -= n;
+      maybeFlush();
+    } while (len > 0);
+    out.push_back('"');
+  }
+};
+
+}; // namespace extism
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+namespace extism {
+
+// A bounded queue with one producer and one consumer. Neither side takes a
+// lock or waits for the other: each only writes its own index, and a slot is
+// handed over by publishing the index past it. The capacity is rounded up to
+// a power of two
+template <typename T> class LogRing {
+public:
+  explicit LogRing(size_t capacity) : slots(roundUp(capacity)) {}
+  LogRing(const LogRing &) = delete;
+  LogRing &operator=(const LogRing &) = delete;
+
+  // Producer side, returns false without taking `value` if the ring is full
+  bool push(T &value) {
+    const size_t t = this->tail.load(std::memory_order_relaxed);
+    if (t - this->head.load(std::memory_order_acquire) == this->slots.size()) {
+      return false;
+    }
+    this->slots[t & (this->slots.size() - 1)] = std::move(value);
+    this->tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side, returns false if the ring is empty
+  bool pop(T &out) {
+    const size_t h = this->head.load(std::memory_order_relaxed);
+    if (h == this->tail.load(std::memory_order_acquire)) {
+      return false;
+    }
+    out = std::move(this->slots[h & (this->slots.size() - 1)]);
+    this->head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  size_t capacity() const { return this->slots.size(); }
+
+private:
+  std::vector<T> slots;
+  // Next slot to pop, only written by the consumer
+  alignas(64) std::atomic<size_t> head{0};
+  // Next slot to push, only written by the producer
+  alignas(64) std::atomic<size_t> tail{0};
+
+  static size_t roundUp(size_t n) {
+    size_t size = 1;
+    while (size < n) {
+      size <<= 1;
+    }
+    return size;
+  }
+};
+
+}; // namespace extism
@@ -0,0 +1,188 @@
+#include "extism.hpp"
+#include "log_ring.hpp"
+
+#include <condition_variable>
+#include <thread>
+
+namespace extism {
+
+namespace {
+
+// Set while this thread runs the callback, which already holds `delivering`
+thread_local bool inCallback = false;
+
+// libextism buffers custom log lines until they are drained. A collector
+// thread drains them every few milliseconds into a ring, and a delivery
+// thread hands the ring to the callback in batches, so a slow callback can
+// neither hold up the guests nor let libextism's buffer grow. When the
+// callback falls a full ring behind, new lines are dropped and counted.
+// While no callback is set the collector waits for one, and the delivery
+// thread waits for the collector
+class LogSink {
+public:
+  static constexpr size_t capacity = 8192;
+  static constexpr size_t batchSize = 256;
+  static constexpr std::chrono::milliseconds interval{5};
+
+  LogSink() : ring(capacity) {}
+
+  // The threads run until exit, the sink must already be installed
+  void start() {
+    std::thread([this]() { this->collectLoop(); }).detach();
+    std::thread([this]() { this->deliverLoop(); }).detach();
+  }
+
+  void setCallback(LogCallback callback) {
+    auto shared = callback ? std::make_shared<const LogCallback>(
+                                 std::move(callback))
+                           : nullptr;
+    {
+      std::lock_guard<std::mutex> lock(this->callbackMutex);
+      this->callback = std::move(shared);
+    }
+    this->callbackSet.notify_all();
+  }
+
+  // Drain libextism into the ring, returns the number of lines received
+  uint64_t collect() {
+    std::lock_guard<std::mutex> lock(this->collecting);
+    const uint64_t before = this->lines.load(std::memory_order_relaxed);
+    extism_log_drain(onLine);
+    return this->lines.load(std::memory_order_relaxed) - before;
+  }
+
+  // Empty the ring into the callback. From inside the callback this does
+  // nothing, the lines are delivered once it returns
+  void deliver() {
+    if (inCallback) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(this->delivering);
+    std::vector<std::string> batch;
+    batch.reserve(batchSize);
+    for (;;) {
+      std::string line;
+      while (batch.size() < batchSize && this->ring.pop(line)) {
+        batch.push_back(std::move(line));
+      }
+      if (batch.empty()) {
+        return;
+      }
+      std::shared_ptr<const LogCallback> callback;
+      {
+        std::lock_guard<std::mutex> lock(this->callbackMutex);
+        callback = this->callback;
+      }
+      if (callback) {
+        inCallback = true;
+        try {
+          (*callback)(batch);
+        } catch (...) {
+          // Nowhere to report it, the delivery thread has to keep going
+        }
+        inCallback = false;
+      }
+      batch.clear();
+    }
+  }
+
+  LogStats stats() const {
+    return LogStats{this->lines.load(), this->dropped.load()};
+  }
+
+private:
+  LogRing<std::string> ring;
+  std::atomic<uint64_t> lines{0};
+  std::atomic<uint64_t> dropped{0};
+  // Held while acting as the ring's producer or consumer, by the background
+  // threads or flushLogs
+  std::mutex collecting;
+  std::mutex delivering;
+  std::mutex callbackMutex;
+  std::condition_variable callbackSet;
+  std::shared_ptr<const LogCallback> callback;
+  std::mutex wakeMutex;
+  std::condition_variable wake;
+  bool pending = false;
+
+  static void onLine(const char *data, ExtismSize size);
+
+  void collectLoop() {
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(this->callbackMutex);
+        this->callbackSet.wait(lock,
+                               [this]() { return this->callback != nullptr; });
+      }
+      if (this->collect() > 0) {
+        {
+          std::lock_guard<std::mutex> lock(this->wakeMutex);
+          this->pending = true;
+        }
+        this->wake.notify_one();
+      }
+      std::this_thread::sleep_for(interval);
+    }
+  }
+
+  void deliverLoop() {
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(this->wakeMutex);
+        this->wake.wait(lock, [this]() { return this->pending; });
+        this->pending = false;
+      }
+      this->deliver();
+    }
+  }
+};
+
+constexpr std::chrono::milliseconds LogSink::interval;
+
+std::mutex installMutex;
+// Never freed, libextism's logger can't be removed once installed
+std::atomic<LogSink *> sink{nullptr};
+
+void LogSink::onLine(const char *data, ExtismSize size) {
+  auto s = sink.load(std::memory_order_acquire);
+  std::string line(data, size);
+  while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) {
+    line.pop_back();
+  }
+  s->lines.fetch_add(1, std::memory_order_relaxed);
+  if (!s->ring.push(line)) {
+    s->dropped.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+} // namespace
+
+bool setLogCallback(const char *level, LogCallback callback) {
+  std::lock_guard<std::mutex> lock(installMutex);
+  auto s = sink.load(std::memory_order_acquire);
+  if (s == nullptr) {
+    if (!extism_log_custom(level)) {
+      return false;
+    }
+    s = new LogSink();
+    sink.store(s, std::memory_order_release);
+    s->start();
+  }
+  s->setCallback(std::move(callback));
+  return true;
+}
+
+void flushLogs() {
+  auto s = sink.load(std::memory_order_acquire);
+  if (s != nullptr) {
+    s->collect();
+    s->deliver();
+  }
+}
+
+LogStats logStats() {
+  auto s = sink.load(std::memory_order_acquire);
+  return s != nullptr ? s->stats() : LogStats{0, 0};
+}
+
+}; // namespace extism
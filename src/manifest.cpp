@@ -1,33 +1,15 @@
+#include "base64.hpp"
 #include "extism.hpp"
-#include <algorithm>
-#include <json/json.h>
+#include "json_writer.hpp"
+#include "sha256.hpp"
 
-namespace extism {
+#include <condition_variable>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-static std::string base64_encode(const uint8_t *data, size_t len) {
-  const size_t out_len = ((len + 3 - 1) / 3) * 4;
-  std::string out(out_len, '\0');
-  static const char alpha[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-                              "abcdefghijklmnopqrstuvwxyz"
-                              "0123456789+/";
-
-  char *out_cursor = out.data();
-  while (len > 0) {
-    const size_t to_encode = std::min<size_t>(3, len);
-    len -= to_encode;
-    uint8_t c[4];
-    c[1] = c[2] = 0;
-    memcpy(c, data, to_encode);
-    data += to_encode;
-    const uint32_t u =
-        (uint32_t)c[0] << 16 | (uint32_t)c[1] << 8 | (uint32_t)c[2];
-    *out_cursor++ = alpha[u >> 18];
-    *out_cursor++ = alpha[u >> 12 & 63];
-    *out_cursor++ = to_encode < 2 ? '=' : alpha[u >> 6 & 63];
-    *out_cursor++ = to_encode < 3 ? '=' : alpha[u & 63];
-  }
-  return out;
-}
+namespace extism {
 
 // Create Wasm pointing to a path
 Wasm Wasm::path(std::string s, std::string hash) {
@@ -41,6 +23,41 @@ Wasm Wasm::url(std::string s, std::string hash, std::string method,
               std::move(hash));
 }
 
+WasmBytes WasmBytes::mapFile(const std::filesystem::path &path) {
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw Error("Unable to open " + path.string());
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw Error("Unable to stat " + path.string());
+  }
+  const size_t size = static_cast<size_t>(st.st_size);
+  if (size == 0) {
+    // Empty mappings aren't allowed
+    close(fd);
+    return WasmBytes(std::vector<uint8_t>());
+  }
+  void *addr = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping keeps the file open
+  close(fd);
+  if (addr == MAP_FAILED) {
+    throw Error("Unable to map " + path.string());
+  }
+  return WasmBytes(std::shared_ptr<const uint8_t[]>(
+                       static_cast<const uint8_t *>(addr),
+                       [size](const uint8_t *p) {
+                         munmap(const_cast<uint8_t *>(p), size);
+                       }),
+                   size);
+}
+
+// Create Wasm from a memory-mapped file
+Wasm Wasm::mmap(const std::string &path, std::string hash) {
+  return Wasm(WasmBytes::mapFile(path), std::move(hash));
+}
+
 // Create Wasm from bytes of a module
 Wasm Wasm::bytes(const uint8_t *data, const size_t len, std::string hash) {
   return Wasm(WasmBytes(data, len), std::move(hash));
@@ -50,87 +67,193 @@ Wasm Wasm::bytes(const std::vector<uint8_t> &data, std::string hash) {
   return Wasm::bytes(data.data(), data.size(), std::move(hash));
 }
 
+Wasm Wasm::bytes(const uint8_t *data, const size_t len, AutoHash) {
+  WasmBytes bytes(data, len);
+  auto hash = bytes.sha256();
+  return Wasm(std::move(bytes), std::move(hash));
+}
+
+Wasm Wasm::bytes(const std::vector<uint8_t> &data, AutoHash) {
+  return Wasm::bytes(data.data(), data.size(), autoHash);
+}
+
+std::string WasmBytes::sha256() const {
+  if (this->digest == nullptr) {
+    // Moved from
+    return sha256_hex(this->get(), this->getSize());
+  }
+  std::call_once(this->digest->once, [this]() {
+    this->digest->hex = sha256_hex(this->get(), this->getSize());
+  });
+  return this->digest->hex;
+}
+
 class Serializer {
 public:
-  static Json::Value json(const Wasm &wasm, const bool selfContained = true) {
-    Json::Value doc;
-
+  // Upper bound on the size of the serialized Wasm, ignoring escaping
+  static size_t estimate(const Wasm &wasm, const bool selfContained) {
+    size_t n = 64 + wasm._hash.size();
     if (std::holds_alternative<std::filesystem::path>(wasm.src)) {
-      doc["path"] = std::string(std::get<std::filesystem::path>(wasm.src));
+      n += std::get<std::filesystem::path>(wasm.src).native().size();
     } else if (std::holds_alternative<WasmURL>(wasm.src)) {
       const auto &wasmURL = std::get<WasmURL>(wasm.src);
-      doc["url"] = wasmURL.url;
-      doc["method"] = wasmURL.httpMethod;
-      if (!wasmURL.httpHeaders.empty()) {
-        Json::Value h;
-        for (auto k : wasmURL.httpHeaders) {
-          h[k.first] = k.second;
-        }
-        doc["headers"] = h;
+      n += wasmURL.url.size() + wasmURL.httpMethod.size();
+      for (const auto &k : wasmURL.httpHeaders) {
+        n += k.first.size() + k.second.size() + 6;
       }
-    } else if (std::holds_alternative<WasmBytes>(wasm.src)) {
+    } else if (std::holds_alternative<WasmBytes>(wasm.src) && selfContained) {
+      n += base64_encoded_length(std::get<WasmBytes>(wasm.src).getSize());
+    }
+    return n;
+  }
+
+  // Keys are written in sorted order to match Json::FastWriter
+  static void write(JsonWriter &w, const Wasm &wasm,
+                    const bool selfContained = true) {
+    bool first = true;
+    auto key = [&w, &first](std::string_view k) {
+      w.raw(first ? '{' : ',');
+      first = false;
+      w.key(k);
+    };
+
+    if (std::holds_alternative<WasmBytes>(wasm.src)) {
       const auto &wasmBytes = std::get<WasmBytes>(wasm.src);
       auto src = wasmBytes.get();
       auto srcSize = wasmBytes.getSize();
+      key("data");
       if (selfContained) {
-        doc["data"] = base64_encode(src, srcSize);
+        w.base64(src, srcSize);
       } else {
-        Json::Value data;
-        data["ptr"] = reinterpret_cast<uint64_t>(src);
-        data["len"] = static_cast<uint64_t>(srcSize);
-        doc["data"] = data;
+        w.raw("{\"len\":");
+        w.number(static_cast<uint64_t>(srcSize));
+        w.raw(",\"ptr\":");
+        w.number(reinterpret_cast<uint64_t>(src));
+        w.raw('}');
       }
     }
 
     if (!wasm._hash.empty()) {
-      doc["hash"] = wasm._hash;
+      key("hash");
+      w.string(wasm._hash);
     }
 
-    return doc;
+    if (std::holds_alternative<std::filesystem::path>(wasm.src)) {
+      key("path");
+      w.string(std::get<std::filesystem::path>(wasm.src).native());
+    } else if (std::holds_alternative<WasmURL>(wasm.src)) {
+      const auto &wasmURL = std::get<WasmURL>(wasm.src);
+      if (!wasmURL.httpHeaders.empty()) {
+        key("headers");
+        writeMap(w, wasmURL.httpHeaders);
+      }
+      key("method");
+      w.string(wasmURL.httpMethod);
+      key("url");
+      w.string(wasmURL.url);
+    }
+    w.raw(first ? "{}" : "}");
   }
-};
 
-std::string Manifest::json(const bool selfContained) const {
-  Json::Value doc;
-  Json::Value wasm;
-  for (const auto &w : this->wasm) {
-    wasm.append(Serializer::json(w, selfContained));
+  static void writeMap(JsonWriter &w,
+                       const std::map<std::string, std::string> &m) {
+    w.raw('{');
+    bool first = true;
+    for (const auto &k : m) {
+      if (!first) {
+        w.raw(',');
+      }
+      first = false;
+      w.key(k.first);
+      w.string(k.second);
+    }
+    w.raw('}');
   }
 
-  doc["wasm"] = wasm;
+  static size_t estimate(const Manifest &manifest, const bool selfContained) {
+    size_t n = 128;
+    for (const auto &w : manifest.wasm) {
+      n += estimate(w, selfContained);
+    }
+    for (const auto &k : manifest.config) {
+      n += k.first.size() + k.second.size() + 6;
+    }
+    for (const auto &h : manifest.allowedHosts) {
+      n += h.size() + 3;
+    }
+    for (const auto &k : manifest.allowedPaths) {
+      n += k.first.size() + k.second.size() + 6;
+    }
+    return n;
+  }
 
-  if (!this->config.empty()) {
-    Json::Value conf;
+  static void write(JsonWriter &w, const Manifest &manifest,
+                    const bool selfContained) {
+    w.raw('{');
+    if (!manifest.allowedHosts.empty()) {
+      w.key("allowed_hosts");
+      w.raw('[');
+      bool first = true;
+      for (const auto &s : manifest.allowedHosts) {
+        if (!first) {
+          w.raw(',');
+        }
+        first = false;
+        w.string(s);
+      }
+      w.raw("],");
+    }
 
-    for (auto k : this->config) {
-      conf[k.first] = k.second;
+    if (!manifest.allowedPaths.empty()) {
+      w.key("allowed_paths");
+      writeMap(w, manifest.allowedPaths);
+      w.raw(',');
     }
-    doc["config"] = conf;
-  }
 
-  if (!this->allowedHosts.empty()) {
-    Json::Value h;
+    if (!manifest.config.empty()) {
+      w.key("config");
+      writeMap(w, manifest.config);
+      w.raw(',');
+    }
 
-    for (auto s : this->allowedHosts) {
-      h.append(s);
+    if (manifest.timeout.has_value()) {
+      w.key("timeout_ms");
+      w.number(*manifest.timeout);
+      w.raw(',');
     }
-    doc["allowed_hosts"] = h;
-  }
 
-  if (!this->allowedPaths.empty()) {
-    Json::Value h;
-    for (auto k : this->allowedPaths) {
-      h[k.first] = k.second;
+    w.key("wasm");
+    if (manifest.wasm.empty()) {
+      // An empty Json::Value array is written as null
+      w.raw("null");
+    } else {
+      w.raw('[');
+      bool first = true;
+      for (const auto &wasm : manifest.wasm) {
+        if (!first) {
+          w.raw(',');
+        }
+        first = false;
+        write(w, wasm, selfContained);
+      }
+      w.raw(']');
     }
-    doc["allowed_paths"] = h;
+    w.raw("}\n");
   }
+};
 
-  if (this->timeout.has_value()) {
-    doc["timeout_ms"] = Json::Value(*this->timeout);
-  }
+std::string Manifest::json(const bool selfContained) const {
+  std::string out;
+  JsonWriter writer(out);
+  writer.reserve(Serializer::estimate(*this, selfContained));
+  Serializer::write(writer, *this, selfContained);
+  return out;
+}
 
-  Json::FastWriter writer;
-  return writer.write(doc);
+void Manifest::json(const JsonSink &sink, const bool selfContained) const {
+  JsonWriter writer(sink);
+  Serializer::write(writer, *this, selfContained);
+  writer.flush();
 }
 
 Manifest Manifest::wasmPath(std::string s, std::string hash) {
@@ -197,6 +320,80 @@ void Manifest::allowPath(std::string src, std::string dest) {
 // Set timeout in milliseconds
 void Manifest::setTimeout(uint64_t ms) { this->timeout = ms; }
 
+// Limit the fuel each call may use
+void Manifest::setFuelLimit(uint64_t fuel) { this->fuelLimit = fuel; }
+
+void Manifest::computeHashes() {
+  std::vector<Wasm *> pending;
+  for (auto &w : this->wasm) {
+    if (w._hash.empty() && !std::holds_alternative<WasmURL>(w.src)) {
+      pending.push_back(&w);
+    }
+  }
+  if (pending.empty()) {
+    return;
+  }
+
+  struct Work {
+    std::vector<Wasm *> wasm;
+    std::atomic<size_t> next{0};
+    std::mutex mutex;
+    std::condition_variable done;
+    size_t finished = 0;
+    std::exception_ptr error;
+  };
+  auto work = std::make_shared<Work>();
+  work->wasm = std::move(pending);
+
+  // Workers claim modules until none are left. The caller works too and
+  // claims whatever the others haven't, so a task still queued behind other
+  // work when the caller finishes does nothing
+  auto run = [](Work &work) {
+    size_t i;
+    while ((i = work.next.fetch_add(1)) < work.wasm.size()) {
+      auto &w = *work.wasm[i];
+      std::exception_ptr error;
+      try {
+        if (std::holds_alternative<WasmBytes>(w.src)) {
+          w._hash = std::get<WasmBytes>(w.src).sha256();
+        } else {
+          w._hash =
+              WasmBytes::mapFile(std::get<std::filesystem::path>(w.src))
+                  .sha256();
+        }
+      } catch (...) {
+        error = std::current_exception();
+      }
+      std::lock_guard<std::mutex> lock(work.mutex);
+      if (error != nullptr && work.error == nullptr) {
+        work.error = error;
+      }
+      if (++work.finished == work.wasm.size()) {
+        work.done.notify_all();
+      }
+    }
+  };
+
+  auto &executor = Executor::shared();
+  const size_t helpers =
+      std::min(work->wasm.size() - 1, executor.threads());
+  for (size_t i = 0; i < helpers; i++) {
+    executor.submit([work, run]() { run(*work); });
+  }
+  run(*work);
+
+  std::unique_lock<std::mutex> lock(work->mutex);
+  work->done.wait(lock,
+                  [&work]() { return work->finished == work->wasm.size(); });
+  if (work->error != nullptr) {
+    std::rethrow_exception(work->error);
+  }
+}
+
+void Manifest::setModuleCache(std::shared_ptr<ModuleCache> cache) {
+  this->moduleCache = std::move(cache);
+}
+
 // Set config key/value
 void Manifest::setConfig(std::string k, std::string v) {
   this->config[std::move(k)] = std::move(v);
@@ -0,0 +1,317 @@
+#include "metrics.hpp"
+
+#include <cmath>
+#include <cstdio>
+
+namespace extism {
+
+// Values below subBuckets get a bucket each, above that every power of two
+// is split into subBuckets buckets by the bits following the leading one
+size_t LatencyHistogram::bucket(uint64_t value) {
+  if (value < subBuckets) {
+    return value;
+  }
+  const size_t exponent = 63 - __builtin_clzll(value);
+  const size_t mantissa = (value >> (exponent - 3)) & (subBuckets - 1);
+  return (exponent - 2) * subBuckets + mantissa;
+}
+
+uint64_t LatencyHistogram::bucketLowerBound(size_t index) {
+  if (index < subBuckets) {
+    return index;
+  }
+  const size_t exponent = index / subBuckets + 2;
+  const uint64_t mantissa = index % subBuckets;
+  return (subBuckets + mantissa) << (exponent - 3);
+}
+
+uint64_t LatencyHistogram::quantile(double q) const {
+  if (this->count == 0) {
+    return 0;
+  }
+  const uint64_t rank = std::max<uint64_t>(
+      1, static_cast<uint64_t>(std::ceil(q * static_cast<double>(count))));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < bucketCount; i++) {
+    seen += this->counts[i];
+    if (seen >= rank) {
+      return i + 1 < bucketCount ? bucketLowerBound(i + 1) - 1 : UINT64_MAX;
+    }
+  }
+  return UINT64_MAX;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other) {
+  for (size_t i = 0; i < bucketCount; i++) {
+    this->counts[i] += other.counts[i];
+  }
+  this->count += other.count;
+  this->sum += other.sum;
+}
+
+void CallStats::merge(const CallStats &other) {
+  this->calls += other.calls;
+  this->errors += other.errors;
+  this->inputBytes += other.inputBytes;
+  this->outputBytes += other.outputBytes;
+  this->latency.merge(other.latency);
+}
+
+void MetricsSnapshot::merge(const MetricsSnapshot &other) {
+  for (const auto &e : other.exports) {
+    this->exports[e.first].merge(e.second);
+  }
+  for (const auto &e : other.hostFunctions) {
+    this->hostFunctions[e.first].merge(e.second);
+  }
+}
+
+static void appendLabelValue(std::string &out, std::string_view value) {
+  for (char c : value) {
+    switch (c) {
+    case '\\':
+      out += "\\\\";
+      break;
+    case '"':
+      out += "\\\"";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    default:
+      out += c;
+    }
+  }
+}
+
+// Write the samples of one metric family, `label` names the export or host
+// function label
+static void
+appendFamily(std::string &out, const std::map<std::string, CallStats> &stats,
+             std::string_view prefix, std::string_view label,
+             std::string_view labels, bool withBytes) {
+  auto sample = [&](std::string_view name, const std::string &key,
+                    std::string_view extra, const std::string &value) {
+    out += prefix;
+    out += name;
+    out += '{';
+    if (!labels.empty()) {
+      out += labels;
+      out += ',';
+    }
+    out += label;
+    out += "=\"";
+    appendLabelValue(out, key);
+    out += '"';
+    out += extra;
+    out += "} ";
+    out += value;
+    out += '\n';
+  };
+  auto counter = [&](std::string_view name, uint64_t CallStats::*field) {
+    out += "# TYPE ";
+    out += prefix;
+    out += name;
+    out += " counter\n";
+    for (const auto &e : stats) {
+      sample(name, e.first, "", std::to_string(e.second.*field));
+    }
+  };
+
+  if (stats.empty()) {
+    return;
+  }
+  counter("_calls_total", &CallStats::calls);
+  counter("_errors_total", &CallStats::errors);
+  if (withBytes) {
+    counter("_input_bytes_total", &CallStats::inputBytes);
+    counter("_output_bytes_total", &CallStats::outputBytes);
+  }
+
+  // Exported with power of two boundaries from about 1us to 34s, which are
+  // also bucket boundaries of LatencyHistogram
+  const size_t minExponent = 10;
+  const size_t maxExponent = 35;
+  out += "# TYPE ";
+  out += prefix;
+  out += "_duration_seconds histogram\n";
+  for (const auto &e : stats) {
+    const auto &h = e.second.latency;
+    uint64_t cumulative = 0;
+    size_t index = 0;
+    for (size_t exponent = minExponent; exponent <= maxExponent; exponent++) {
+      const uint64_t bound = uint64_t(1) << exponent;
+      while (index < LatencyHistogram::bucketCount &&
+             LatencyHistogram::bucketLowerBound(index) < bound) {
+        cumulative += h.counts[index++];
+      }
+      char le[32];
+      snprintf(le, sizeof(le), ",le=\"%g\"", static_cast<double>(bound) / 1e9);
+      sample("_duration_seconds_bucket", e.first, le,
+             std::to_string(cumulative));
+    }
+    sample("_duration_seconds_bucket", e.first, ",le=\"+Inf\"",
+           std::to_string(h.count));
+    char sum[32];
+    snprintf(sum, sizeof(sum), "%.9f", static_cast<double>(h.sum) / 1e9);
+    sample("_duration_seconds_sum", e.first, "", sum);
+    sample("_duration_seconds_count", e.first, "", std::to_string(h.count));
+  }
+}
+
+std::string prometheusText(const MetricsSnapshot &metrics,
+                           std::string_view labels) {
+  std::string out;
+  appendFamily(out, metrics.exports, "extism_export", "export", labels, true);
+  appendFamily(out, metrics.hostFunctions, "extism_host_function", "function",
+               labels, false);
+  return out;
+}
+
+#ifdef EXTISM_CPP_METRICS
+
+static std::atomic<uint64_t> nextMetricsId{0};
+
+thread_local PluginMetrics *PluginMetrics::current = nullptr;
+
+PluginMetrics::PluginMetrics() : id(nextMetricsId.fetch_add(1)) {}
+
+// The shard of the current thread, created on first use. Threads cache the
+// shards of the plugins they used most recently, ids are never reused so
+// entries of freed plugins are never matched. A plugin evicted from the
+// cache finds the thread's shard again under the lock
+PluginMetrics::Shard &PluginMetrics::local() {
+  struct Cached {
+    uint64_t id;
+    Shard *shard;
+  };
+  static const size_t cacheSize = 16;
+  thread_local std::vector<Cached> cache;
+  for (auto it = cache.rbegin(); it != cache.rend(); ++it) {
+    if (it->id == this->id) {
+      Shard *shard = it->shard;
+      if (it != cache.rbegin()) {
+        // Keep the most recently used plugins at the back
+        cache.erase(std::next(it).base());
+        cache.push_back(Cached{this->id, shard});
+      }
+      return *shard;
+    }
+  }
+
+  Shard *shard;
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    auto &slot = this->shards[std::this_thread::get_id()];
+    if (slot == nullptr) {
+      slot = std::make_unique<Shard>();
+    }
+    shard = slot.get();
+  }
+  if (cache.size() >= cacheSize) {
+    cache.erase(cache.begin());
+  }
+  cache.push_back(Cached{this->id, shard});
+  return *shard;
+}
+
+PluginMetrics::Entry &
+PluginMetrics::entry(Shard &shard,
+                     std::map<std::string, Entry, std::less<>> &entries,
+                     std::string_view name) {
+  auto it = entries.find(name);
+  if (it != entries.end()) {
+    return it->second;
+  }
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  return entries.try_emplace(std::string(name)).first->second;
+}
+
+// Only the owning thread writes to an entry, so a plain load and store is
+// enough
+static void add(std::atomic<uint64_t> &counter, uint64_t n) {
+  counter.store(counter.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+}
+
+void PluginMetrics::record(Entry &entry, uint64_t nanos, bool ok,
+                           uint64_t input, uint64_t output) {
+  add(entry.calls, 1);
+  if (!ok) {
+    add(entry.errors, 1);
+  }
+  add(entry.inputBytes, input);
+  add(entry.outputBytes, output);
+  add(entry.sum, nanos);
+  add(entry.counts[LatencyHistogram::bucket(nanos)], 1);
+}
+
+void PluginMetrics::recordCall(std::string_view func, uint64_t nanos, bool ok,
+                               uint64_t input, uint64_t output) {
+  auto &shard = this->local();
+  record(entry(shard, shard.exports, func), nanos, ok, input, output);
+}
+
+void PluginMetrics::recordHostCall(std::string_view name, uint64_t nanos,
+                                   bool ok) {
+  auto &shard = this->local();
+  record(entry(shard, shard.hostFunctions, name), nanos, ok, 0, 0);
+}
+
+MetricsSnapshot PluginMetrics::snapshot() const {
+  auto load = [](const std::atomic<uint64_t> &a) {
+    return a.load(std::memory_order_relaxed);
+  };
+  auto merge = [&](std::map<std::string, CallStats> &out,
+                   const std::map<std::string, Entry, std::less<>> &entries) {
+    for (const auto &e : entries) {
+      auto &stats = out[e.first];
+      stats.calls += load(e.second.calls);
+      stats.errors += load(e.second.errors);
+      stats.inputBytes += load(e.second.inputBytes);
+      stats.outputBytes += load(e.second.outputBytes);
+      stats.latency.sum += load(e.second.sum);
+      for (size_t i = 0; i < LatencyHistogram::bucketCount; i++) {
+        const uint64_t n = load(e.second.counts[i]);
+        stats.latency.counts[i] += n;
+        stats.latency.count += n;
+      }
+    }
+  };
+
+  MetricsSnapshot snapshot;
+  std::lock_guard<std::mutex> lock(this->mutex);
+  for (const auto &shard : this->shards) {
+    std::lock_guard<std::mutex> shardLock(shard.second->mutex);
+    merge(snapshot.exports, shard.second->exports);
+    merge(snapshot.hostFunctions, shard.second->hostFunctions);
+  }
+  return snapshot;
+}
+
+size_t PluginMetrics::shardCount() const {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  return this->shards.size();
+}
+
+std::shared_ptr<PluginMetrics> Plugin::newMetrics() {
+  return std::make_shared<PluginMetrics>();
+}
+
+HostCallMetrics::HostCallMetrics(const std::string &name) : name(name) {
+  if (PluginMetrics::current != nullptr) {
+    this->start = PluginMetrics::now();
+  }
+}
+
+// Recorded as an error when the host function throws
+HostCallMetrics::~HostCallMetrics() {
+  if (PluginMetrics::current != nullptr) {
+    PluginMetrics::current->recordHostCall(
+        this->name, PluginMetrics::now() - this->start, this->ok);
+  }
+}
+
+#endif
+
+}; // namespace extism
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "extism.hpp"
+
+#ifdef EXTISM_CPP_METRICS
+
+#include <chrono>
+#include <thread>
+
+namespace extism {
+
+// Metrics of one plugin. Each thread records into its own shard without
+// locking, shards are merged when a snapshot is taken
+class PluginMetrics {
+  struct Entry {
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> errors{0};
+    std::atomic<uint64_t> inputBytes{0};
+    std::atomic<uint64_t> outputBytes{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> counts[LatencyHistogram::bucketCount] = {};
+  };
+
+  struct Shard {
+    // Held while inserting new names and while reading, the owning thread
+    // looks up and updates existing entries without it
+    std::mutex mutex;
+    std::map<std::string, Entry, std::less<>> exports;
+    std::map<std::string, Entry, std::less<>> hostFunctions;
+  };
+
+  const uint64_t id;
+  mutable std::mutex mutex;
+  // One shard per thread that has recorded into the plugin
+  std::map<std::thread::id, std::unique_ptr<Shard>> shards;
+
+  Shard &local();
+  static Entry &entry(Shard &shard,
+                      std::map<std::string, Entry, std::less<>> &entries,
+                      std::string_view name);
+  static void record(Entry &entry, uint64_t nanos, bool ok, uint64_t input,
+                     uint64_t output);
+
+public:
+  PluginMetrics();
+
+  void recordCall(std::string_view func, uint64_t nanos, bool ok,
+                  uint64_t input, uint64_t output);
+  void recordHostCall(std::string_view name, uint64_t nanos, bool ok);
+  MetricsSnapshot snapshot() const;
+
+  // Number of threads that have recorded into the plugin
+  size_t shardCount() const;
+
+  static uint64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  // The plugin whose call is running on this thread, host functions record
+  // into it
+  static thread_local PluginMetrics *current;
+
+  // Makes `metrics` current for the lifetime of the scope
+  class Scope {
+    PluginMetrics *previous;
+
+  public:
+    explicit Scope(PluginMetrics *metrics) : previous(current) {
+      current = metrics;
+    }
+    ~Scope() { current = previous; }
+  };
+};
+
+}; // namespace extism
+
+#endif
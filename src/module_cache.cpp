@@ -0,0 +1,301 @@
+#include "extism.hpp"
+#include "sha256.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <fstream>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace extism {
+
+// An exclusive flock on the cache's lock file. Entries are only written and
+// removed while it's held, by this process or any other
+class CacheLock {
+  int fd;
+
+public:
+  explicit CacheLock(const std::filesystem::path &path) {
+    this->fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (this->fd < 0) {
+      throw Error("Unable to open module cache lock " + path.string());
+    }
+    while (flock(this->fd, LOCK_EX) != 0) {
+      if (errno != EINTR) {
+        close(this->fd);
+        throw Error("Unable to lock module cache " + path.string());
+      }
+    }
+  }
+  ~CacheLock() { close(this->fd); }
+  CacheLock(const CacheLock &) = delete;
+  CacheLock &operator=(const CacheLock &) = delete;
+};
+
+static std::string lowercase(std::string s) {
+  for (auto &c : s) {
+    if (c >= 'A' && c <= 'F') {
+      c = c - 'A' + 'a';
+    }
+  }
+  return s;
+}
+
+// Entries are ordered by modification time, which is set explicitly because
+// the kernel only updates it with the resolution of a scheduler tick
+static void touch(const std::filesystem::path &path) {
+  std::error_code ec;
+  std::filesystem::last_write_time(
+      path, std::filesystem::file_time_type::clock::now(), ec);
+}
+
+ModuleCache::ModuleCache(std::filesystem::path directory, uint64_t maxBytes)
+    : root(std::move(directory)), maxBytes(maxBytes) {
+  std::error_code ec;
+  std::filesystem::create_directories(this->root / "modules", ec);
+  if (ec) {
+    throw Error("Unable to create module cache " + this->root.string() +
+                ": " + ec.message());
+  }
+}
+
+// Path of the entry for `hash`, empty if it isn't a SHA-256 digest
+std::filesystem::path ModuleCache::entry(const std::string &hash) const {
+  const auto key = lowercase(hash);
+  if (!sha256_is_hex(key)) {
+    return {};
+  }
+  return this->root / "modules" / (key + ".wasm");
+}
+
+// The inode and size of `path`, which identify an entry's contents since
+// entries are only ever replaced by a rename. The modification time can't
+// be used, hits update it
+static std::optional<std::pair<uint64_t, uint64_t>>
+fileIdentity(const std::filesystem::path &path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    return std::nullopt;
+  }
+  return std::make_pair(static_cast<uint64_t>(st.st_ino),
+                        static_cast<uint64_t>(st.st_size));
+}
+
+std::optional<WasmBytes> ModuleCache::get(const std::string &hash) {
+  const auto path = this->entry(hash);
+  std::optional<WasmBytes> data;
+  std::optional<std::pair<uint64_t, uint64_t>> identity;
+  if (!path.empty()) {
+    identity = fileIdentity(path);
+    try {
+      // Entries are only ever replaced by a rename, so the mapping can't be
+      // truncated under us
+      data = WasmBytes::mapFile(path);
+    } catch (const Error &) {
+    }
+  }
+  if (!data || !identity) {
+    this->misses++;
+    return std::nullopt;
+  }
+
+  const auto key = path.stem().string();
+  bool trusted;
+  {
+    std::lock_guard<std::mutex> lock(this->verifiedMutex);
+    auto it = this->verified.find(key);
+    trusted = it != this->verified.end() && it->second == *identity;
+  }
+  if (!trusted) {
+    if (sha256_hex(data->get(), data->getSize()) != key) {
+      // Truncated by a crash or changed on disk
+      this->corrupted++;
+      this->misses++;
+      std::error_code ec;
+      std::filesystem::remove(path, ec);
+      return std::nullopt;
+    }
+    std::lock_guard<std::mutex> lock(this->verifiedMutex);
+    this->verified[key] = *identity;
+  }
+  touch(path);
+  this->hits++;
+  return data;
+}
+
+std::string ModuleCache::put(const uint8_t *data, size_t len) {
+  return this->put(data, len, sha256_hex(data, len));
+}
+
+std::string ModuleCache::put(const std::vector<uint8_t> &data) {
+  return this->put(data.data(), data.size());
+}
+
+// `hash` must be the digest of the data
+std::string ModuleCache::put(const uint8_t *data, size_t len,
+                             std::string hash) {
+  const auto path = this->entry(hash);
+  CacheLock lock(this->root / "lock");
+  std::error_code ec;
+  if (std::filesystem::exists(path, ec)) {
+    // Stored by another process since the lookup
+    touch(path);
+    return hash;
+  }
+
+  auto tmp = path;
+  tmp += ".tmp." + std::to_string(getpid());
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char *>(data), len);
+    out.close();
+    if (!out) {
+      std::filesystem::remove(tmp, ec);
+      throw Error("Unable to write module cache entry " + tmp.string());
+    }
+  }
+  // The data was hashed before it was written, so reads can trust the file
+  const auto identity = fileIdentity(tmp);
+  std::filesystem::rename(tmp, path, ec);
+  if (ec) {
+    std::filesystem::remove(tmp, ec);
+    throw Error("Unable to store module cache entry " + path.string());
+  }
+  if (identity) {
+    std::lock_guard<std::mutex> lock(this->verifiedMutex);
+    this->verified[path.stem().string()] = *identity;
+  }
+  touch(path);
+  this->trimLocked();
+  return hash;
+}
+
+Manifest ModuleCache::resolve(const Manifest &manifest) {
+  Manifest resolved = manifest;
+  for (auto &wasm : resolved.wasm) {
+    // Path and bytes modules are already local, a cached copy would only
+    // cost a lookup
+    if (wasm._hash.empty() || !std::holds_alternative<WasmURL>(wasm.src)) {
+      continue;
+    }
+    auto cached = this->get(wasm._hash);
+    if (cached) {
+      wasm.src = std::move(*cached);
+    }
+  }
+  return resolved;
+}
+
+void ModuleCache::trim() {
+  CacheLock lock(this->root / "lock");
+  this->trimLocked();
+}
+
+// The lock must be held, so any temporary file found was left behind by a
+// process that died while writing it
+void ModuleCache::trimLocked() {
+  struct Entry {
+    std::filesystem::path path;
+    uintmax_t size;
+    std::filesystem::file_time_type time;
+  };
+  std::vector<Entry> entries;
+  uint64_t total = 0;
+  std::error_code ec;
+  for (const auto &e :
+       std::filesystem::directory_iterator(this->root / "modules", ec)) {
+    if (e.path().extension() != ".wasm") {
+      std::filesystem::remove(e.path(), ec);
+      continue;
+    }
+    const auto size = e.file_size(ec);
+    if (ec) {
+      continue;
+    }
+    const auto time = e.last_write_time(ec);
+    if (ec) {
+      continue;
+    }
+    entries.push_back(Entry{e.path(), size, time});
+    total += size;
+  }
+  if (total <= this->maxBytes) {
+    return;
+  }
+
+  std::sort(entries.begin(), entries.end(),
+            [](const Entry &a, const Entry &b) { return a.time < b.time; });
+  for (const auto &e : entries) {
+    if (total <= this->maxBytes) {
+      break;
+    }
+    if (std::filesystem::remove(e.path, ec)) {
+      total -= e.size;
+      this->evicted++;
+    }
+  }
+}
+
+uint64_t ModuleCache::size() const {
+  uint64_t total = 0;
+  std::error_code ec;
+  for (const auto &e :
+       std::filesystem::directory_iterator(this->root / "modules", ec)) {
+    if (e.path().extension() == ".wasm") {
+      const auto size = e.file_size(ec);
+      total += ec ? 0 : size;
+    }
+  }
+  return total;
+}
+
+ModuleCache::Stats ModuleCache::stats() const {
+  return Stats{this->hits.load(), this->misses.load(), this->corrupted.load(),
+               this->evicted.load()};
+}
+
+void ModuleCache::enableCompiledCache() const {
+  const auto compiled = this->root / "compiled";
+  std::error_code ec;
+  std::filesystem::create_directories(compiled, ec);
+  if (ec) {
+    throw Error("Unable to create " + compiled.string() + ": " +
+                ec.message());
+  }
+
+  std::string directory;
+  for (char c : compiled.string()) {
+    if (c == '"' || c == '\\') {
+      directory += '\\';
+    }
+    directory += c;
+  }
+  const std::string config =
+      "[cache]\nenabled = true\ndirectory = \"" + directory +
+      "\"\nfiles-total-size-soft-limit = \"" +
+      std::to_string(std::max<uint64_t>(1, this->maxBytes >> 10)) + "Ki\"\n";
+
+  // Written like an entry, other processes may be reading it
+  const auto path = this->root / "wasmtime.toml";
+  auto tmp = path;
+  tmp += ".tmp." + std::to_string(getpid());
+  {
+    std::ofstream out(tmp, std::ios::trunc);
+    out << config;
+    out.close();
+    if (!out) {
+      std::filesystem::remove(tmp, ec);
+      throw Error("Unable to write " + tmp.string());
+    }
+  }
+  std::filesystem::rename(tmp, path, ec);
+  if (ec) {
+    std::filesystem::remove(tmp, ec);
+    throw Error("Unable to write " + path.string());
+  }
+  setenv("EXTISM_CACHE_CONFIG", path.c_str(), 1);
+}
+
+}; // namespace extism
@@ -0,0 +1,332 @@
+#include "extism.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <thread>
+
+namespace extism {
+
+// A request on its way through the stages
+struct PipelineRequest {
+  std::shared_ptr<CallFuture::State> state;
+  CallCallback callback;
+  // Input of the first stage
+  std::vector<uint8_t> input;
+  // Output of the last stage that ran, in the memory of the instance held
+  // by `lease`
+  std::optional<Buffer> output;
+  std::shared_ptr<void> lease;
+  // TraceContext of the caller, installed around each stage's call
+  const void *context = TraceContext::current();
+
+  void fail(std::exception_ptr error) {
+    this->output.reset();
+    this->lease.reset();
+    if (this->state != nullptr) {
+      this->state->promise.set_exception(error);
+    } else {
+      try {
+        this->callback({}, error);
+      } catch (...) {
+        // The worker has to keep going, callbacks shouldn't throw
+      }
+    }
+  }
+};
+
+// The queue in front of a stage, push blocks while it is full
+class PipelineQueue {
+  std::mutex mutex;
+  std::condition_variable notEmpty;
+  std::condition_variable notFull;
+  std::deque<std::unique_ptr<PipelineRequest>> items;
+  const size_t capacity;
+  bool closed = false;
+
+public:
+  explicit PipelineQueue(size_t capacity) : capacity(capacity) {}
+
+  void push(std::unique_ptr<PipelineRequest> request) {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->notFull.wait(
+        lock, [this]() { return this->items.size() < this->capacity; });
+    this->items.push_back(std::move(request));
+    lock.unlock();
+    this->notEmpty.notify_one();
+  }
+
+  // Returns nullptr once the queue is closed and empty
+  std::unique_ptr<PipelineRequest> pop() {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->notEmpty.wait(
+        lock, [this]() { return this->closed || !this->items.empty(); });
+    if (this->items.empty()) {
+      return nullptr;
+    }
+    auto request = std::move(this->items.front());
+    this->items.pop_front();
+    lock.unlock();
+    this->notFull.notify_one();
+    return request;
+  }
+
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->closed = true;
+    }
+    this->notEmpty.notify_all();
+  }
+
+  size_t size() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->items.size();
+  }
+};
+
+struct PipelineStage {
+  Plugin *plugin;
+  std::optional<PluginPool> pool;
+  std::string func;
+  PipelineQueue queue;
+  std::vector<std::thread> workers;
+
+  // Set while the output of `plugin` is waiting for the next stage
+  std::mutex mutex;
+  std::condition_variable released;
+  bool leased = false;
+
+  std::atomic<uint64_t> calls{0};
+  std::atomic<uint64_t> errors{0};
+  std::atomic<uint64_t> inputBytes{0};
+  std::atomic<uint64_t> outputBytes{0};
+  std::atomic<uint64_t> busy{0};
+
+  PipelineStage(Plugin *plugin, std::optional<PluginPool> pool,
+                std::string func, size_t queueCapacity)
+      : plugin(plugin), pool(std::move(pool)), func(std::move(func)),
+        queue(queueCapacity) {}
+
+  // Check out the instance to call, it is returned when the lease is
+  // released
+  std::shared_ptr<void> acquire(Plugin *&instance) {
+    if (this->pool) {
+      auto handle =
+          std::make_shared<PluginPool::Handle>(this->pool->acquire());
+      instance = &**handle;
+      return handle;
+    }
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->released.wait(lock, [this]() { return !this->leased; });
+    this->leased = true;
+    instance = this->plugin;
+    return std::shared_ptr<void>(nullptr, [this](void *) {
+      {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->leased = false;
+      }
+      this->released.notify_one();
+    });
+  }
+};
+
+struct Pipeline::Impl {
+  std::vector<std::unique_ptr<PipelineStage>> stages;
+  const std::chrono::steady_clock::time_point started =
+      std::chrono::steady_clock::now();
+
+  ~Impl() {
+    // Stop each stage once the stages before it have finished, so every
+    // submitted request runs to the end
+    for (auto &stage : this->stages) {
+      stage->queue.close();
+      for (auto &worker : stage->workers) {
+        worker.join();
+      }
+    }
+  }
+
+  void run(size_t index) {
+    auto &stage = *this->stages[index];
+    while (auto request = stage.queue.pop()) {
+      this->step(index, std::move(request));
+    }
+  }
+
+  void step(size_t index, std::unique_ptr<PipelineRequest> request) {
+    auto &stage = *this->stages[index];
+    TraceContext trace(request->context);
+    const uint8_t *input = request->input.data();
+    size_t inputLength = request->input.size();
+    if (request->output) {
+      input = request->output->data;
+      inputLength = request->output->length;
+    }
+
+    // Creating a pool instance, or its warm-up, can fail
+    Plugin *plugin = nullptr;
+    std::shared_ptr<void> lease;
+    try {
+      lease = stage.acquire(plugin);
+    } catch (...) {
+      stage.errors++;
+      request->fail(std::current_exception());
+      return;
+    }
+    auto state = request->state.get();
+    if (state != nullptr) {
+      try {
+        state->start(extism_plugin_cancel_handle(plugin->plugin.get()));
+      } catch (...) {
+        lease.reset();
+        request->fail(std::current_exception());
+        return;
+      }
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    std::optional<Buffer> output;
+    std::exception_ptr error;
+    try {
+      output.emplace(plugin->call(stage.func.c_str(), input, inputLength));
+    } catch (...) {
+      error = std::current_exception();
+    }
+    stage.busy += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+    if (state != nullptr) {
+      state->finish();
+    }
+    if (error) {
+      stage.errors++;
+      lease.reset();
+      request->fail(error);
+      return;
+    }
+    stage.calls++;
+    stage.inputBytes += inputLength;
+    stage.outputBytes += output->length;
+
+    // The input has been copied into this stage's instance, so the previous
+    // stage's instance can take its next request
+    request->output.reset();
+    request->lease = std::move(lease);
+    request->output.emplace(*output);
+    request->input = std::vector<uint8_t>();
+
+    if (index + 1 < this->stages.size()) {
+      this->stages[index + 1]->queue.push(std::move(request));
+      return;
+    }
+    auto result = request->output->vector();
+    request->output.reset();
+    request->lease.reset();
+    if (request->state != nullptr) {
+      request->state->promise.set_value(std::move(result));
+    } else {
+      try {
+        request->callback(std::move(result), nullptr);
+      } catch (...) {
+        // The worker has to keep going, callbacks shouldn't throw
+      }
+    }
+  }
+};
+
+Pipeline::Builder &Pipeline::Builder::stage(Plugin &plugin,
+                                            std::string func) {
+  this->stages.push_back(Stage{&plugin, std::nullopt, std::move(func), 1});
+  return *this;
+}
+
+Pipeline::Builder &Pipeline::Builder::stage(const PluginPool &pool,
+                                            std::string func,
+                                            size_t concurrency) {
+  this->stages.push_back(
+      Stage{nullptr, pool, std::move(func), std::max<size_t>(concurrency, 1)});
+  return *this;
+}
+
+Pipeline::Builder &Pipeline::Builder::queueSize(size_t size) {
+  this->queueCapacity = std::max<size_t>(size, 1);
+  return *this;
+}
+
+Pipeline Pipeline::Builder::build() {
+  if (this->stages.empty()) {
+    throw Error("A pipeline needs at least one stage");
+  }
+  // A stage that shares instances with a later one could hold all of them
+  // with outputs the later stage needs an instance to take
+  for (size_t i = 0; i < this->stages.size(); i++) {
+    for (size_t j = i + 1; j < this->stages.size(); j++) {
+      const auto &a = this->stages[i];
+      const auto &b = this->stages[j];
+      if ((a.plugin != nullptr && a.plugin == b.plugin) ||
+          (a.pool && b.pool && a.pool->state == b.pool->state)) {
+        throw Error("Pipeline stages " + std::to_string(i) + " and " +
+                    std::to_string(j) + " use the same plug-in");
+      }
+    }
+  }
+
+  auto impl = std::make_unique<Impl>();
+  for (const auto &s : this->stages) {
+    impl->stages.push_back(std::make_unique<PipelineStage>(
+        s.plugin, s.pool, s.func, this->queueCapacity));
+  }
+  for (size_t i = 0; i < this->stages.size(); i++) {
+    for (size_t n = 0; n < this->stages[i].concurrency; n++) {
+      impl->stages[i]->workers.emplace_back(
+          [impl = impl.get(), i]() { impl->run(i); });
+    }
+  }
+  return Pipeline(std::move(impl));
+}
+
+Pipeline::Pipeline(std::unique_ptr<Impl> impl) : impl(std::move(impl)) {}
+
+Pipeline::Pipeline(Pipeline &&) = default;
+
+Pipeline &Pipeline::operator=(Pipeline &&) = default;
+
+Pipeline::~Pipeline() = default;
+
+CallFuture Pipeline::submit(std::vector<uint8_t> input) const {
+  auto request = std::make_unique<PipelineRequest>();
+  request->state = std::make_shared<CallFuture::State>();
+  request->input = std::move(input);
+  CallFuture future(request->state);
+  this->impl->stages.front()->queue.push(std::move(request));
+  return future;
+}
+
+CallFuture Pipeline::submit(std::string_view input) const {
+  return this->submit(std::vector<uint8_t>(input.begin(), input.end()));
+}
+
+void Pipeline::submit(std::vector<uint8_t> input,
+                      CallCallback callback) const {
+  auto request = std::make_unique<PipelineRequest>();
+  request->callback = std::move(callback);
+  request->input = std::move(input);
+  this->impl->stages.front()->queue.push(std::move(request));
+}
+
+std::vector<Pipeline::StageStats> Pipeline::stats() const {
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - this->impl->started;
+  std::vector<StageStats> stats;
+  for (const auto &stage : this->impl->stages) {
+    const uint64_t calls = stage->calls.load();
+    stats.push_back(StageStats{
+        stage->func, calls, stage->errors.load(), stage->inputBytes.load(),
+        stage->outputBytes.load(), std::chrono::nanoseconds(stage->busy.load()),
+        stage->queue.size(),
+        elapsed.count() > 0 ? calls / elapsed.count() : 0.0});
+  }
+  return stats;
+}
+
+}; // namespace extism
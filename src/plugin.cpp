@@ -1,5 +1,9 @@
 #include "extism.hpp"
-#include <json/json.h>
+#include "metrics.hpp"
+#include "timer_wheel.hpp"
+#include <algorithm>
+#include <cstring>
+#include <deque>
 
 namespace extism {
 
@@ -8,16 +12,26 @@ void extism::Plugin::PluginDeleter::operator()(ExtismPlugin *plugin) const {
 }
 
 Plugin::Plugin(const uint8_t *wasm, size_t length, bool withWasi,
-               std::vector<Function> functions)
-    : functions(std::move(functions)) {
+               std::vector<Function> functions,
+               std::optional<uint64_t> fuelLimit)
+    : functions(std::make_shared<const std::vector<Function>>(
+          std::move(functions))),
+      fuel(fuelLimit) {
+  TraceSpan trace(Span::Kind::Create, "", length);
   std::vector<const ExtismFunction *> ptrs;
-  for (auto i : this->functions) {
+  for (const auto &i : *this->functions) {
     ptrs.push_back(i.get());
   }
 
   char *errmsg = nullptr;
-  this->plugin = unique_plugin(extism_plugin_new(
-      wasm, length, ptrs.data(), ptrs.size(), withWasi, &errmsg));
+  if (fuelLimit.has_value()) {
+    this->plugin = unique_plugin(extism_plugin_new_with_fuel_limit(
+        wasm, length, ptrs.data(), ptrs.size(), withWasi, *fuelLimit,
+        &errmsg));
+  } else {
+    this->plugin = unique_plugin(extism_plugin_new(
+        wasm, length, ptrs.data(), ptrs.size(), withWasi, &errmsg));
+  }
   if (this->plugin == nullptr) {
     std::string s(errmsg);
     extism_plugin_new_error_free(errmsg);
@@ -26,38 +40,53 @@ Plugin::Plugin(const uint8_t *wasm, size_t length, bool withWasi,
 }
 
 Plugin::Plugin(std::string_view str, bool withWasi,
-               std::vector<Function> functions)
+               std::vector<Function> functions,
+               std::optional<uint64_t> fuelLimit)
     : Plugin(reinterpret_cast<const uint8_t *>(str.data()), str.size(),
-             withWasi, std::move(functions)) {}
+             withWasi, std::move(functions), fuelLimit) {}
 
 Plugin::Plugin(const std::vector<uint8_t> &data, bool withWasi,
-               std::vector<Function> functions)
-    : Plugin(data.data(), data.size(), withWasi, std::move(functions)) {}
+               std::vector<Function> functions,
+               std::optional<uint64_t> fuelLimit)
+    : Plugin(data.data(), data.size(), withWasi, std::move(functions),
+             fuelLimit) {}
+
+// Create a new plugin from an already compiled module
+Plugin::Plugin(const CompiledPlugin &compiled)
+    : functions(compiled.functions), compiled(compiled.compiled) {
+  TraceSpan trace(Span::Kind::Create, "");
+  char *errmsg = nullptr;
+  this->plugin = unique_plugin(
+      extism_plugin_new_from_compiled(this->compiled.get(), &errmsg));
+  if (this->plugin == nullptr) {
+    std::string s(errmsg);
+    extism_plugin_new_error_free(errmsg);
+    throw Error(s);
+  }
+}
 
 Plugin::CancelHandle Plugin::cancelHandle() {
   return CancelHandle(extism_plugin_cancel_handle(this->plugin.get()));
 }
 
-// Create a new plugin from Manifest
+// Create a new plugin from Manifest. A manifest resolved through its module
+// cache lives until the end of the full expression, so the module bytes it
+// points to outlive plugin creation
 Plugin::Plugin(const Manifest &manifest, bool withWasi,
                std::vector<Function> functions)
-    : Plugin(manifest.json(false), withWasi, std::move(functions)) {}
+    : Plugin(manifest.moduleCache != nullptr
+                 ? manifest.moduleCache->resolve(manifest).json(false)
+                 : manifest.json(false),
+             withWasi, std::move(functions), manifest.fuelLimit) {}
 
 bool Plugin::CancelHandle::cancel() {
   return extism_plugin_cancel(this->handle);
 }
 
-void Plugin::config(const Config &data) {
-  Json::Value conf;
+void Plugin::config(const Config &data) { this->config(ConfigBlob(data)); }
 
-  for (auto k : data) {
-    conf[k.first] = k.second;
-  }
-
-  Json::FastWriter writer;
-  auto s = writer.write(conf);
-  this->config(s);
-}
+// Apply pre-serialized config updates
+void Plugin::config(const ConfigBlob &blob) { this->config(blob.json()); }
 
 void Plugin::config(const char *json, size_t length) {
   bool b = extism_plugin_config(
@@ -72,22 +101,151 @@ void Plugin::config(std::string_view json) {
   this->config(json.data(), json.size());
 }
 
-// Call a plugin
-Buffer Plugin::call(const char *func, const uint8_t *input,
-                    size_t inputLength) const {
-  int32_t rc = extism_plugin_call(this->plugin.get(), func, input, inputLength);
+// Cancels a call when its deadline passes, run on the timer wheel thread.
+// libextism drops a cancel that arrives before the call has started, so the
+// timer repeats every tick until the call returns and removes it
+struct CallExpiry {
+  const ExtismCancelHandle *handle;
+  std::atomic<bool> fired{false};
+
+  static void fire(void *arg) {
+    auto expiry = static_cast<CallExpiry *>(arg);
+    expiry->fired = true;
+    extism_plugin_cancel(expiry->handle);
+  }
+};
+
+void Plugin::callRaw(const char *func, const uint8_t *input,
+                     size_t inputLength, std::optional<Deadline> deadline,
+                     void *hostContext) const {
+  this->invalidateBuffers();
+  if (deadline && *deadline <= std::chrono::steady_clock::now()) {
+    throw TimeoutError("Deadline passed before the call started");
+  }
+#ifdef EXTISM_CPP_METRICS
+  PluginMetrics::Scope scope(this->metricsData.get());
+  const uint64_t start = PluginMetrics::now();
+#endif
+  TraceSpan trace(Span::Kind::Call, func, inputLength);
+  int32_t rc;
+  bool timedOut = false;
+  if (deadline) {
+    CallExpiry expiry{extism_plugin_cancel_handle(this->plugin.get())};
+    auto &wheel = TimerWheel::shared();
+    auto timer = wheel.add(*deadline, CallExpiry::fire, &expiry, true);
+    rc = extism_plugin_call_with_host_context(
+        this->plugin.get(), func, input, inputLength, hostContext);
+    // Once the timer is removed `expiry` is no longer used by the wheel
+    wheel.remove(timer);
+    timedOut = rc != 0 && expiry.fired;
+  } else {
+    rc = extism_plugin_call_with_host_context(
+        this->plugin.get(), func, input, inputLength, hostContext);
+  }
+#ifdef EXTISM_CPP_METRICS
+  this->metricsData->recordCall(
+      func, PluginMetrics::now() - start, rc == 0, inputLength,
+      rc == 0 ? extism_plugin_output_length(this->plugin.get()) : 0);
+#endif
+  if (trace.active() && rc == 0) {
+    trace.output(extism_plugin_output_length(this->plugin.get()));
+  }
+  if (timedOut) {
+    throw TimeoutError("Deadline exceeded");
+  }
   if (rc != 0) {
     const char *error = extism_plugin_error(this->plugin.get());
     if (error == nullptr) {
       throw Error("extism_call failed");
     }
+    // Wasmtime's out of fuel trap
+    if (this->fuel.has_value() &&
+        std::string_view(error).find("all fuel consumed") !=
+            std::string_view::npos) {
+      throw FuelExhausted(error);
+    }
 
     throw Error(error);
   }
+}
 
+// Call a plugin
+Buffer Plugin::call(const char *func, const uint8_t *input,
+                    size_t inputLength) const {
+  this->callRaw(func, input, inputLength);
+  ExtismSize length = extism_plugin_output_length(this->plugin.get());
+  const uint8_t *ptr = extism_plugin_output_data(this->plugin.get());
+#ifdef EXTISM_CPP_CHECK_BUFFERS
+  return Buffer(ptr, length, this->generation);
+#else
+  return Buffer(ptr, length);
+#endif
+}
+
+// Call a plugin, cancelling the call if it is still running at `deadline`.
+// Throws TimeoutError if it was cancelled
+Buffer Plugin::call(const char *func, const uint8_t *input, size_t inputLength,
+                    Deadline deadline) const {
+  this->callRaw(func, input, inputLength, deadline);
+  ExtismSize length = extism_plugin_output_length(this->plugin.get());
+  const uint8_t *ptr = extism_plugin_output_data(this->plugin.get());
+#ifdef EXTISM_CPP_CHECK_BUFFERS
+  return Buffer(ptr, length, this->generation);
+#else
+  return Buffer(ptr, length);
+#endif
+}
+
+// Call a plugin function with std::vector<uint8_t> input and a deadline
+Buffer Plugin::call(const char *func, const std::vector<uint8_t> &input,
+                    Deadline deadline) const {
+  return this->call(func, input.data(), input.size(), deadline);
+}
+
+// Call a plugin function with string input and a deadline
+Buffer Plugin::call(const char *func, std::string_view input,
+                    Deadline deadline) const {
+  return this->call(func, reinterpret_cast<const uint8_t *>(input.data()),
+                    input.size(), deadline);
+}
+
+// Call a plugin function with string input and a deadline
+Buffer Plugin::call(const std::string &func, std::string_view input,
+                    Deadline deadline) const {
+  return this->call(func.c_str(), input, deadline);
+}
+
+// Call a plugin, host functions can read `hostContext` with
+// CurrentPlugin::hostContext
+Buffer Plugin::call(const char *func, const uint8_t *input, size_t inputLength,
+                    void *hostContext) const {
+  this->callRaw(func, input, inputLength, std::nullopt, hostContext);
   ExtismSize length = extism_plugin_output_length(this->plugin.get());
   const uint8_t *ptr = extism_plugin_output_data(this->plugin.get());
+#ifdef EXTISM_CPP_CHECK_BUFFERS
+  return Buffer(ptr, length, this->generation);
+#else
   return Buffer(ptr, length);
+#endif
+}
+
+// Call a plugin function with std::vector<uint8_t> input and a host context
+Buffer Plugin::call(const char *func, const std::vector<uint8_t> &input,
+                    void *hostContext) const {
+  return this->call(func, input.data(), input.size(), hostContext);
+}
+
+// Call a plugin function with string input and a host context
+Buffer Plugin::call(const char *func, std::string_view input,
+                    void *hostContext) const {
+  return this->call(func, reinterpret_cast<const uint8_t *>(input.data()),
+                    input.size(), hostContext);
+}
+
+// Call a plugin function with string input and a host context
+Buffer Plugin::call(const std::string &func, std::string_view input,
+                    void *hostContext) const {
+  return this->call(func.c_str(), input, hostContext);
 }
 
 // Call a plugin function with std::vector<uint8_t> input
@@ -118,6 +276,257 @@ Buffer Plugin::call(const std::string &func, std::string_view input) const {
   return this->call(func.c_str(), input);
 }
 
+// Call a plugin and copy the output into an OwnedBuffer
+OwnedBuffer Plugin::callOwned(const char *func, const uint8_t *input,
+                              size_t inputLength) const {
+  this->callRaw(func, input, inputLength);
+  ExtismSize length = extism_plugin_output_length(this->plugin.get());
+  const uint8_t *ptr = extism_plugin_output_data(this->plugin.get());
+  return OwnedBuffer(ptr, length);
+}
+
+// Call a plugin function with string input and copy the output into an
+// OwnedBuffer
+OwnedBuffer Plugin::callOwned(const char *func, std::string_view input) const {
+  return this->callOwned(func, reinterpret_cast<const uint8_t *>(input.data()),
+                         input.size());
+}
+
+// Call a plugin function with string input and copy the output into an
+// OwnedBuffer
+OwnedBuffer Plugin::callOwned(const std::string &func,
+                              std::string_view input) const {
+  return this->callOwned(func.c_str(), input);
+}
+
+// Call a plugin and copy the output into `out`, which must be at least
+// `outLength` bytes. Returns the length of the output, if that is larger than
+// `outLength` nothing is copied
+size_t Plugin::callInto(const char *func, const uint8_t *input,
+                        size_t inputLength, uint8_t *out,
+                        size_t outLength) const {
+  this->callRaw(func, input, inputLength);
+  ExtismSize length = extism_plugin_output_length(this->plugin.get());
+  if (length <= outLength) {
+    memcpy(out, extism_plugin_output_data(this->plugin.get()), length);
+  }
+  return length;
+}
+
+// Call a plugin function with string input and copy the output into `out`
+size_t Plugin::callInto(const char *func, std::string_view input, uint8_t *out,
+                        size_t outLength) const {
+  return this->callInto(func, reinterpret_cast<const uint8_t *>(input.data()),
+                        input.size(), out, outLength);
+}
+
+// Call a plugin function with string input and replace the contents of `out`
+// with the output, reusing its capacity
+void Plugin::callInto(const char *func, std::string_view input,
+                      std::vector<uint8_t> &out) const {
+  this->callRaw(func, reinterpret_cast<const uint8_t *>(input.data()),
+                input.size());
+  ExtismSize length = extism_plugin_output_length(this->plugin.get());
+  const uint8_t *ptr = extism_plugin_output_data(this->plugin.get());
+  out.assign(ptr, ptr + length);
+}
+
+// Call a plugin function once for each input, the outputs are copied into a
+// single buffer. Failed calls are recorded without stopping the batch
+BatchResult Plugin::callBatch(const char *func, const std::string_view *inputs,
+                              size_t count, size_t resetEvery) const {
+  this->invalidateBuffers();
+  BatchResult result;
+  result.offsets.reserve(count + 1);
+  auto plugin = this->plugin.get();
+#ifdef EXTISM_CPP_METRICS
+  PluginMetrics::Scope scope(this->metricsData.get());
+#endif
+  for (size_t i = 0; i < count; i++) {
+#ifdef EXTISM_CPP_METRICS
+    const uint64_t start = PluginMetrics::now();
+#endif
+    TraceSpan trace(Span::Kind::Call, func, inputs[i].size());
+    int32_t rc =
+        extism_plugin_call(plugin, func,
+                           reinterpret_cast<const uint8_t *>(inputs[i].data()),
+                           inputs[i].size());
+#ifdef EXTISM_CPP_METRICS
+    this->metricsData->recordCall(
+        func, PluginMetrics::now() - start, rc == 0, inputs[i].size(),
+        rc == 0 ? extism_plugin_output_length(plugin) : 0);
+#endif
+    if (trace.active()) {
+      if (rc == 0) {
+        trace.output(extism_plugin_output_length(plugin));
+      } else {
+        trace.failed();
+      }
+    }
+    if (rc != 0) {
+      const char *error = extism_plugin_error(plugin);
+      result.errors.emplace_back(i, error == nullptr ? "extism_call failed"
+                                                     : error);
+    } else {
+      ExtismSize length = extism_plugin_output_length(plugin);
+      const uint8_t *ptr = extism_plugin_output_data(plugin);
+      result.arena.insert(result.arena.end(), ptr, ptr + length);
+    }
+    result.offsets.push_back(result.arena.size());
+
+    if (resetEvery > 0 && (i + 1) % resetEvery == 0) {
+      extism_plugin_reset(plugin);
+    }
+  }
+  return result;
+}
+
+// Call a plugin function once for each input
+BatchResult Plugin::callBatch(const char *func,
+                              const std::vector<std::string_view> &inputs,
+                              size_t resetEvery) const {
+  return this->callBatch(func, inputs.data(), inputs.size(), resetEvery);
+}
+
+// Call a plugin function once for each input
+BatchResult Plugin::callBatch(const std::string &func,
+                              const std::vector<std::string_view> &inputs,
+                              size_t resetEvery) const {
+  return this->callBatch(func.c_str(), inputs.data(), inputs.size(),
+                         resetEvery);
+}
+
+Buffer BatchResult::operator[](size_t index) const {
+  if (index >= this->size()) {
+    throw Error("Batch index out of bounds");
+  }
+  return Buffer(this->arena.data() + this->offsets[index],
+                this->offsets[index + 1] - this->offsets[index]);
+}
+
+// Returns true if the call for input `index` succeeded
+bool BatchResult::ok(size_t index) const {
+  auto it = std::lower_bound(
+      this->errors.begin(), this->errors.end(), index,
+      [](const auto &e, size_t index) { return e.first < index; });
+  return index < this->size() &&
+         (it == this->errors.end() || it->first != index);
+}
+
+struct Plugin::AsyncQueue {
+  std::mutex mutex;
+  std::deque<std::function<void()>> calls;
+  // Set while a task on the executor is working through `calls`
+  bool running = false;
+
+  // Run the next call and submit a task for the one after, so a plugin
+  // holds at most one worker and other tasks get a turn in between
+  static void drain(std::shared_ptr<AsyncQueue> queue, Executor &executor) {
+    std::function<void()> call;
+    {
+      std::lock_guard<std::mutex> lock(queue->mutex);
+      call = std::move(queue->calls.front());
+      queue->calls.pop_front();
+    }
+    try {
+      call();
+    } catch (...) {
+      // Only a throwing callback gets here, the queue has to keep going
+    }
+    {
+      std::lock_guard<std::mutex> lock(queue->mutex);
+      if (queue->calls.empty()) {
+        queue->running = false;
+        return;
+      }
+    }
+    executor.submit([queue, &executor]() { drain(queue, executor); });
+  }
+};
+
+std::shared_ptr<Plugin::AsyncQueue> Plugin::newAsyncQueue() {
+  return std::make_shared<AsyncQueue>();
+}
+
+// Queue an asynchronous call, calls made while another is queued or running
+// follow it on the executor it was submitted to
+void Plugin::enqueueAsync(std::function<void()> call,
+                          Executor &executor) const {
+  {
+    std::lock_guard<std::mutex> lock(this->asyncQueue->mutex);
+    this->asyncQueue->calls.push_back(std::move(call));
+    if (this->asyncQueue->running) {
+      return;
+    }
+    this->asyncQueue->running = true;
+  }
+  executor.submit([queue = this->asyncQueue, &executor]() {
+    AsyncQueue::drain(queue, executor);
+  });
+}
+
+std::vector<uint8_t> Plugin::asyncCall(const std::string &func,
+                                       const std::vector<uint8_t> &input,
+                                       CallFuture::State *state) const {
+  if (state == nullptr) {
+    return this->call(func, input).vector();
+  }
+
+  state->start(extism_plugin_cancel_handle(this->plugin.get()));
+  struct Finish {
+    CallFuture::State *state;
+    ~Finish() { state->finish(); }
+  } finish{state};
+  return this->call(func, input).vector();
+}
+
+// Call a plugin function on `executor`, the plugin must outlive the call
+CallFuture Plugin::callAsync(std::string func, std::vector<uint8_t> input,
+                             Executor &executor) const {
+  auto state = std::make_shared<CallFuture::State>();
+  CallFuture future(state);
+  this->enqueueAsync(
+      [this, state, func = std::move(func), input = std::move(input),
+       context = TraceContext::current()]() {
+        // Spans on the worker belong to the caller's context
+        TraceContext trace(context);
+        try {
+          state->promise.set_value(this->asyncCall(func, input, state.get()));
+        } catch (...) {
+          state->promise.set_exception(std::current_exception());
+        }
+      },
+      executor);
+  return future;
+}
+
+// Call a plugin function with string input on `executor`
+CallFuture Plugin::callAsync(std::string func, std::string_view input,
+                             Executor &executor) const {
+  return this->callAsync(std::move(func),
+                         std::vector<uint8_t>(input.begin(), input.end()),
+                         executor);
+}
+
+// Call a plugin function on `executor` and pass the result to `callback`
+void Plugin::callAsync(std::string func, std::vector<uint8_t> input,
+                       CallCallback callback, Executor &executor) const {
+  this->enqueueAsync(
+      [this, func = std::move(func), input = std::move(input),
+       callback = std::move(callback), context = TraceContext::current()]() {
+        TraceContext trace(context);
+        std::vector<uint8_t> output;
+        try {
+          output = this->asyncCall(func, input, nullptr);
+        } catch (...) {
+          callback({}, std::current_exception());
+          return;
+        }
+        callback(std::move(output), nullptr);
+      },
+      executor);
+}
+
 // Returns true if the specified function exists
 bool Plugin::functionExists(const char *func) const {
   return extism_plugin_function_exists(this->plugin.get(), func);
@@ -128,8 +537,21 @@ bool Plugin::functionExists(const std::string &func) const {
   return extism_plugin_function_exists(this->plugin.get(), func.c_str());
 }
 
+// Calls made by this plugin and its host functions so far
+MetricsSnapshot Plugin::metrics() const {
+#ifdef EXTISM_CPP_METRICS
+  return this->metricsData->snapshot();
+#else
+  return MetricsSnapshot();
+#endif
+}
+
 // Reset the Extism runtime, this will invalidate all allocated memory
 // returns true if it succeeded
-bool Plugin::reset() const { return extism_plugin_reset(this->plugin.get()); }
+bool Plugin::reset() const {
+  this->invalidateBuffers();
+  TraceSpan trace(Span::Kind::Reset, "");
+  return extism_plugin_reset(this->plugin.get());
+}
 
 }; // namespace extism
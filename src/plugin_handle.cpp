@@ -0,0 +1,67 @@
+#include "extism.hpp"
+
+namespace extism {
+
+PluginHandle::PluginHandle(const Manifest &manifest, bool withWasi,
+                           std::vector<Function> functions, size_t maxSize)
+    : options(Options{withWasi, std::move(functions), maxSize}) {
+  this->current = std::make_shared<const Version>(Version{
+      PluginPool(manifest, withWasi, this->options->functions, maxSize), 1});
+}
+
+PluginHandle::PluginHandle(PluginPool pool)
+    : current(std::make_shared<const Version>(Version{std::move(pool), 1})) {}
+
+// A reference to the current version. libstdc++ guards the copy with a
+// spinlock from a small pool, held only for the reference count increment
+std::shared_ptr<const PluginHandle::Version> PluginHandle::load() const {
+  return std::atomic_load(&this->current);
+}
+
+uint64_t PluginHandle::reload(const Manifest &manifest) {
+  if (!this->options) {
+    throw Error("A PluginHandle created from a pool can only be reloaded "
+                "with a pool");
+  }
+  return this->reload(PluginPool(manifest, this->options->withWasi,
+                                 this->options->functions,
+                                 this->options->maxSize));
+}
+
+uint64_t PluginHandle::reload(PluginPool pool) {
+  std::lock_guard<std::mutex> lock(*this->reloading);
+  const uint64_t number = this->load()->number + 1;
+  auto next = std::make_shared<const Version>(Version{std::move(pool), number});
+  // The old version is freed here, or by the last call still using it
+  std::atomic_store(&this->current, std::move(next));
+  return number;
+}
+
+OwnedBuffer PluginHandle::call(const char *func, const uint8_t *input,
+                               size_t inputLength) const {
+  auto plugin = this->acquire();
+  return plugin->callOwned(func, input, inputLength);
+}
+
+OwnedBuffer PluginHandle::call(const char *func,
+                               std::string_view input) const {
+  return this->call(func, reinterpret_cast<const uint8_t *>(input.data()),
+                    input.size());
+}
+
+OwnedBuffer PluginHandle::call(const std::string &func,
+                               std::string_view input) const {
+  return this->call(func.c_str(), input);
+}
+
+// The handle holds the version's pool, so the version only has to be
+// referenced while checking out
+PluginPool::Handle PluginHandle::acquire() const {
+  return this->load()->pool.acquire();
+}
+
+PluginPool PluginHandle::pool() const { return this->load()->pool; }
+
+uint64_t PluginHandle::version() const { return this->load()->number; }
+
+}; // namespace extism
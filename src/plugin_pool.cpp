@@ -0,0 +1,324 @@
+#include "extism.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace extism {
+
+struct PluginPool::State {
+  struct Slot {
+    std::unique_ptr<Plugin> plugin;
+    std::thread::id owner;
+  };
+
+  CompiledPlugin compiled;
+  mutable std::mutex mutex;
+  std::condition_variable available;
+  // Idle instances, the most recently returned instance is at the back
+  std::vector<Slot> idle;
+  size_t live = 0;
+  size_t maxSize;
+  // Run on new instances, replaced as a whole so creation can run a copy
+  // outside of the lock
+  std::shared_ptr<const std::function<void(Plugin &)>> warmUp;
+  // Asynchronous calls waiting for an instance, each submits its call to
+  // the executor again
+  std::deque<std::function<void()>> waiting;
+
+  State(CompiledPlugin compiled, size_t maxSize)
+      : compiled(std::move(compiled)), maxSize(maxSize) {}
+
+  // Take an idle instance, preferring the one this thread used last.
+  // `mutex` must be held
+  std::unique_ptr<Plugin> takeIdle() {
+    const auto self = std::this_thread::get_id();
+    auto it = idle.rbegin();
+    for (; it != idle.rend(); ++it) {
+      if (it->owner == self) {
+        break;
+      }
+    }
+    if (it == idle.rend()) {
+      it = idle.rbegin();
+    }
+    auto plugin = std::move(it->plugin);
+    idle.erase(std::next(it).base());
+    return plugin;
+  }
+
+  // Take the next waiting call, to be run once `mutex` is released.
+  // `mutex` must be held
+  std::function<void()> nextWaiting() {
+    if (waiting.empty()) {
+      return nullptr;
+    }
+    auto next = std::move(waiting.front());
+    waiting.pop_front();
+    return next;
+  }
+
+  // Create and warm up a new instance, `live` must already account for it
+  std::unique_ptr<Plugin> create() {
+    try {
+      auto plugin = std::make_unique<Plugin>(compiled);
+      std::shared_ptr<const std::function<void(Plugin &)>> warmUp;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        warmUp = this->warmUp;
+      }
+      if (warmUp != nullptr) {
+        (*warmUp)(*plugin);
+      }
+      return plugin;
+    } catch (...) {
+      std::function<void()> next;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        live -= 1;
+        next = nextWaiting();
+      }
+      available.notify_one();
+      if (next) {
+        next();
+      }
+      throw;
+    }
+  }
+
+  void put(std::unique_ptr<Plugin> plugin) {
+    std::function<void()> next;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (live <= maxSize) {
+        idle.push_back(Slot{std::move(plugin), std::this_thread::get_id()});
+      } else {
+        live -= 1;
+      }
+      next = nextWaiting();
+    }
+    available.notify_one();
+    if (next) {
+      next();
+    }
+    // If the instance was dropped it is freed here, outside of the lock
+  }
+};
+
+static size_t defaultMaxSize(size_t maxSize) {
+  if (maxSize > 0) {
+    return maxSize;
+  }
+  return std::max<size_t>(1, std::thread::hardware_concurrency());
+}
+
+PluginPool::PluginPool(CompiledPlugin compiled, size_t maxSize)
+    : state(std::make_shared<State>(std::move(compiled),
+                                    defaultMaxSize(maxSize))) {}
+
+PluginPool::PluginPool(const Manifest &manifest, bool withWasi,
+                       std::vector<Function> functions, size_t maxSize)
+    : PluginPool(CompiledPlugin(manifest, withWasi, std::move(functions)),
+                 maxSize) {}
+
+PluginPool::Handle::Handle(std::shared_ptr<State> state,
+                           std::unique_ptr<Plugin> plugin)
+    : state(std::move(state)), plugin(std::move(plugin)) {}
+
+void PluginPool::Handle::release() {
+  if (this->plugin != nullptr) {
+    this->state->put(std::move(this->plugin));
+  }
+}
+
+PluginPool::Handle &PluginPool::Handle::operator=(Handle &&h) {
+  if (this != &h) {
+    this->release();
+    this->state = std::move(h.state);
+    this->plugin = std::move(h.plugin);
+  }
+  return *this;
+}
+
+PluginPool::Handle::~Handle() { this->release(); }
+
+// Check out an instance, blocking while all `maxSize` instances are in use
+PluginPool::Handle PluginPool::acquire() const {
+  std::unique_lock<std::mutex> lock(state->mutex);
+  state->available.wait(lock, [this]() {
+    return !state->idle.empty() || state->live < state->maxSize;
+  });
+  if (!state->idle.empty()) {
+    return Handle(state, state->takeIdle());
+  }
+  state->live += 1;
+  lock.unlock();
+  return Handle(state, state->create());
+}
+
+// Check out an instance without blocking, returns std::nullopt if all
+// `maxSize` instances are in use
+std::optional<PluginPool::Handle> PluginPool::tryAcquire() const {
+  std::unique_lock<std::mutex> lock(state->mutex);
+  if (!state->idle.empty()) {
+    return Handle(state, state->takeIdle());
+  }
+  if (state->live >= state->maxSize) {
+    return std::nullopt;
+  }
+  state->live += 1;
+  lock.unlock();
+  return Handle(state, state->create());
+}
+
+// Free idle instances until at most `size` remain
+void PluginPool::shrink(size_t size) const {
+  std::vector<State::Slot> dropped;
+  {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    // The coldest instances are at the front
+    auto it = state->idle.begin();
+    while (it != state->idle.end() && state->live > size) {
+      dropped.push_back(std::move(*it));
+      ++it;
+      state->live -= 1;
+    }
+    state->idle.erase(state->idle.begin(), it);
+  }
+}
+
+void PluginPool::setWarmUp(std::function<void(Plugin &)> warmUp) const {
+  auto f = warmUp ? std::make_shared<const std::function<void(Plugin &)>>(
+                        std::move(warmUp))
+                  : nullptr;
+  std::lock_guard<std::mutex> lock(state->mutex);
+  state->warmUp = std::move(f);
+}
+
+// Create instances one at a time, each is idle before the next is created
+// so concurrent acquires can use it
+void PluginPool::prewarm(size_t count) const {
+  for (;;) {
+    {
+      std::lock_guard<std::mutex> lock(state->mutex);
+      if (state->idle.size() >= count || state->live >= state->maxSize) {
+        return;
+      }
+      state->live += 1;
+    }
+    state->put(state->create());
+  }
+}
+
+// Instead of blocking in acquire, a call that finds every instance in use
+// is queued in `waiting` under the same lock, so a return can't slip in
+// between, and is submitted again when an instance is returned
+void PluginPool::whenAvailable(
+    std::function<void(const std::function<Handle()> &)> call,
+    Executor &executor) const {
+  executor.submit([pool = *this, call = std::move(call), &executor]() {
+    auto &state = pool.state;
+    std::unique_ptr<Plugin> plugin;
+    {
+      std::lock_guard<std::mutex> lock(state->mutex);
+      if (!state->idle.empty()) {
+        plugin = state->takeIdle();
+      } else if (state->live < state->maxSize) {
+        state->live += 1;
+      } else {
+        state->waiting.push_back(
+            [pool, call, &executor]() { pool.whenAvailable(call, executor); });
+        return;
+      }
+    }
+    call([&]() {
+      return Handle(state,
+                    plugin != nullptr ? std::move(plugin) : state->create());
+    });
+  });
+}
+
+// Call a plugin function on `executor` using the next available instance
+CallFuture PluginPool::callAsync(std::string func, std::vector<uint8_t> input,
+                                 Executor &executor) const {
+  auto state = std::make_shared<CallFuture::State>();
+  CallFuture future(state);
+  this->whenAvailable(
+      [state, func = std::move(func), input = std::move(input),
+       context = TraceContext::current()](
+          const std::function<Handle()> &acquire) {
+        // Spans on the worker belong to the caller's context
+        TraceContext trace(context);
+        try {
+          auto plugin = acquire();
+          state->promise.set_value(
+              plugin->asyncCall(func, input, state.get()));
+        } catch (...) {
+          state->promise.set_exception(std::current_exception());
+        }
+      },
+      executor);
+  return future;
+}
+
+// Call a plugin function with string input on `executor`
+CallFuture PluginPool::callAsync(std::string func, std::string_view input,
+                                 Executor &executor) const {
+  return this->callAsync(std::move(func),
+                         std::vector<uint8_t>(input.begin(), input.end()),
+                         executor);
+}
+
+// Call a plugin function on `executor` and pass the result to `callback`
+void PluginPool::callAsync(std::string func, std::vector<uint8_t> input,
+                           CallCallback callback, Executor &executor) const {
+  this->whenAvailable(
+      [func = std::move(func), input = std::move(input),
+       callback = std::move(callback), context = TraceContext::current()](
+          const std::function<Handle()> &acquire) {
+        TraceContext trace(context);
+        std::vector<uint8_t> output;
+        try {
+          auto plugin = acquire();
+          output = plugin->asyncCall(func, input, nullptr);
+        } catch (...) {
+          callback({}, std::current_exception());
+          return;
+        }
+        callback(std::move(output), nullptr);
+      },
+      executor);
+}
+
+// Change the maximum number of instances, instances above the new limit
+// are freed as they become idle
+void PluginPool::setMaxSize(size_t maxSize) const {
+  std::deque<std::function<void()>> waiting;
+  {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    state->maxSize = defaultMaxSize(maxSize);
+    // Calls that can't start yet queue again
+    waiting.swap(state->waiting);
+  }
+  state->available.notify_all();
+  for (auto &next : waiting) {
+    next();
+  }
+  this->shrink(defaultMaxSize(maxSize));
+}
+
+// Number of live instances, including those checked out
+size_t PluginPool::size() const {
+  std::lock_guard<std::mutex> lock(state->mutex);
+  return state->live;
+}
+
+// Number of idle instances
+size_t PluginPool::idle() const {
+  std::lock_guard<std::mutex> lock(state->mutex);
+  return state->idle.size();
+}
+
+}; // namespace extism
@@ -0,0 +1,281 @@
+#include "sha256.hpp"
+
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define EXTISM_SHA256_X86
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__)
+#define EXTISM_SHA256_ARM
+#include <arm_neon.h>
+#ifdef __linux__
+#include <sys/auxv.h>
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6)
+#endif
+#endif
+#ifdef __clang__
+#define EXTISM_SHA256_ARM_TARGET __attribute__((target("sha2")))
+#else
+#define EXTISM_SHA256_ARM_TARGET __attribute__((target("+crypto")))
+#endif
+#endif
+
+namespace extism {
+
+static const uint32_t k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static const uint32_t initialState[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                         0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                         0x1f83d9ab, 0x5be0cd19};
+
+static inline uint32_t rotr(uint32_t x, int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+static inline uint32_t loadBigEndian(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         (uint32_t)p[3];
+}
+
+void sha256_compress_scalar(uint32_t state[8], const uint8_t *blocks,
+                            size_t count) {
+  for (; count > 0; count--, blocks += 64) {
+    uint32_t w[64];
+    for (size_t i = 0; i < 16; i++) {
+      w[i] = loadBigEndian(blocks + i * 4);
+    }
+    for (size_t i = 16; i < 64; i++) {
+      const uint32_t s0 =
+          rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      const uint32_t s1 =
+          rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (size_t i = 0; i < 64; i++) {
+      const uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+      const uint32_t ch = (e & f) ^ (~e & g);
+      const uint32_t t1 = h + s1 + ch + k[i] + w[i];
+      const uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+      const uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+      const uint32_t t2 = s0 + maj;
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+  }
+}
+
+// The compressors below use the SHA extensions, which run two rounds per
+// instruction and do the message schedule in vector registers. Each group of
+// four rounds uses four schedule words, kept in msg[group % 4], and the
+// schedule for group g + 4 is computed while group g runs. They follow the
+// Intel and ARM reference code.
+
+#ifdef EXTISM_SHA256_X86
+__attribute__((target("sha,sse4.1"))) static void
+sha256_compress_shani(uint32_t state[8], const uint8_t *blocks,
+                      size_t count) {
+  const __m128i byteSwap =
+      _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+  // The round instructions want the state as ABEF and CDGH
+  __m128i tmp = _mm_loadu_si128(reinterpret_cast<const __m128i *>(state));
+  __m128i state1 =
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(state + 4));
+  tmp = _mm_shuffle_epi32(tmp, 0xb1);
+  state1 = _mm_shuffle_epi32(state1, 0x1b);
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+  state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+  for (; count > 0; count--, blocks += 64) {
+    const __m128i abef = state0;
+    const __m128i cdgh = state1;
+    __m128i msg[4];
+#pragma GCC unroll 16
+    for (size_t g = 0; g < 16; g++) {
+      if (g < 4) {
+        msg[g] = _mm_shuffle_epi8(
+            _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(blocks + g * 16)),
+            byteSwap);
+      }
+      __m128i w = _mm_add_epi32(
+          msg[g % 4],
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(k + g * 4)));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, w);
+      if (g >= 3 && g < 15) {
+        const __m128i last = msg[g % 4];
+        __m128i &next = msg[(g + 1) % 4];
+        next = _mm_add_epi32(next, _mm_alignr_epi8(last, msg[(g + 3) % 4], 4));
+        next = _mm_sha256msg2_epu32(next, last);
+      }
+      w = _mm_shuffle_epi32(w, 0x0e);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, w);
+      if (g >= 1 && g < 13) {
+        __m128i &oldest = msg[(g + 3) % 4];
+        oldest = _mm_sha256msg1_epu32(oldest, msg[g % 4]);
+      }
+    }
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1b);
+  state1 = _mm_shuffle_epi32(state1, 0xb1);
+  state0 = _mm_blend_epi16(tmp, state1, 0xf0);
+  state1 = _mm_alignr_epi8(state1, tmp, 8);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(state), state0);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(state + 4), state1);
+}
+#endif
+
+#ifdef EXTISM_SHA256_ARM
+EXTISM_SHA256_ARM_TARGET static void
+sha256_compress_armv8(uint32_t state[8], const uint8_t *blocks,
+                      size_t count) {
+  uint32x4_t state0 = vld1q_u32(state);
+  uint32x4_t state1 = vld1q_u32(state + 4);
+
+  for (; count > 0; count--, blocks += 64) {
+    const uint32x4_t abcd = state0;
+    const uint32x4_t efgh = state1;
+    uint32x4_t msg[4];
+    for (size_t g = 0; g < 4; g++) {
+      msg[g] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(blocks + g * 16)));
+    }
+#pragma GCC unroll 16
+    for (size_t g = 0; g < 16; g++) {
+      const uint32x4_t w = vaddq_u32(msg[g % 4], vld1q_u32(k + g * 4));
+      if (g < 12) {
+        msg[g % 4] = vsha256su0q_u32(msg[g % 4], msg[(g + 1) % 4]);
+      }
+      const uint32x4_t previous = state0;
+      state0 = vsha256hq_u32(state0, state1, w);
+      state1 = vsha256h2q_u32(state1, previous, w);
+      if (g < 12) {
+        msg[g % 4] =
+            vsha256su1q_u32(msg[g % 4], msg[(g + 2) % 4], msg[(g + 3) % 4]);
+      }
+    }
+    state0 = vaddq_u32(state0, abcd);
+    state1 = vaddq_u32(state1, efgh);
+  }
+
+  vst1q_u32(state, state0);
+  vst1q_u32(state + 4, state1);
+}
+
+static bool sha256_armv8_supported() {
+#if defined(__APPLE__)
+  return true;
+#elif defined(__linux__)
+  return (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+#else
+  return false;
+#endif
+}
+#endif
+
+std::vector<std::pair<const char *, Sha256Compressor>> sha256_compressors() {
+  std::vector<std::pair<const char *, Sha256Compressor>> compressors = {
+      {"scalar", sha256_compress_scalar}};
+#ifdef EXTISM_SHA256_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1")) {
+    compressors.emplace_back("shani", sha256_compress_shani);
+  }
+#endif
+#ifdef EXTISM_SHA256_ARM
+  if (sha256_armv8_supported()) {
+    compressors.emplace_back("armv8", sha256_compress_armv8);
+  }
+#endif
+  return compressors;
+}
+
+void sha256(const uint8_t *data, size_t len, uint8_t *out) {
+  static const Sha256Compressor compress = sha256_compressors().back().second;
+  sha256(compress, data, len, out);
+}
+
+void sha256(Sha256Compressor compress, const uint8_t *data, size_t len,
+            uint8_t *out) {
+  uint32_t state[8];
+  memcpy(state, initialState, sizeof(state));
+  const size_t full = len / 64;
+  compress(state, data, full);
+
+  // The rest of the input, a one bit, zeros and the length in bits fill one
+  // or two final blocks
+  uint8_t tail[128] = {};
+  const size_t rest = len - full * 64;
+  memcpy(tail, data + full * 64, rest);
+  tail[rest] = 0x80;
+  const size_t tailLength = rest < 56 ? 64 : 128;
+  const uint64_t bits = static_cast<uint64_t>(len) * 8;
+  for (size_t i = 0; i < 8; i++) {
+    tail[tailLength - 1 - i] = static_cast<uint8_t>(bits >> (i * 8));
+  }
+  compress(state, tail, tailLength / 64);
+
+  for (size_t i = 0; i < 8; i++) {
+    out[i * 4] = static_cast<uint8_t>(state[i] >> 24);
+    out[i * 4 + 1] = static_cast<uint8_t>(state[i] >> 16);
+    out[i * 4 + 2] = static_cast<uint8_t>(state[i] >> 8);
+    out[i * 4 + 3] = static_cast<uint8_t>(state[i]);
+  }
+}
+
+std::string sha256_hex(const uint8_t *data, size_t len) {
+  static const char digits[] = "0123456789abcdef";
+  uint8_t digest[sha256_length];
+  sha256(data, len, digest);
+  std::string out(sha256_length * 2, '\0');
+  for (size_t i = 0; i < sha256_length; i++) {
+    out[i * 2] = digits[digest[i] >> 4];
+    out[i * 2 + 1] = digits[digest[i] & 15];
+  }
+  return out;
+}
+
+bool sha256_is_hex(const std::string &s) {
+  if (s.size() != sha256_length * 2) {
+    return false;
+  }
+  for (char c : s) {
+    if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+}; // namespace extism
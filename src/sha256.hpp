@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace extism {
+
+// Length of a SHA-256 digest in bytes
+static const size_t sha256_length = 32;
+
+// Compress `count` 64-byte blocks into the eight state words
+typedef void (*Sha256Compressor)(uint32_t state[8], const uint8_t *blocks,
+                                 size_t count);
+
+// Portable compressor, one round at a time
+void sha256_compress_scalar(uint32_t state[8], const uint8_t *blocks,
+                            size_t count);
+
+// Every compressor supported by the CPU, by name, starting with the scalar
+// one
+std::vector<std::pair<const char *, Sha256Compressor>> sha256_compressors();
+
+// Hash `len` bytes into `out`, which must have room for sha256_length bytes.
+// Uses the fastest compressor supported by the CPU
+void sha256(const uint8_t *data, size_t len, uint8_t *out);
+
+// Hash with a specific compressor
+void sha256(Sha256Compressor compress, const uint8_t *data, size_t len,
+            uint8_t *out);
+
+// Hash `len` bytes, returns the digest as lowercase hex like the `hash` of a
+// manifest
+std::string sha256_hex(const uint8_t *data, size_t len);
+
+// True if `s` looks like a hex SHA-256 digest
+bool sha256_is_hex(const std::string &s);
+
+}; // namespace extism
@@ -0,0 +1,142 @@
+#include "extism.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <unistd.h>
+
+namespace extism {
+
+size_t IstreamSource::read(uint8_t *buf, size_t len) {
+  this->in.read(reinterpret_cast<char *>(buf), len);
+  const auto n = static_cast<size_t>(this->in.gcount());
+  if (n == 0 && this->in.bad()) {
+    throw Error("Unable to read stream input");
+  }
+  return n;
+}
+
+void OstreamSink::write(const uint8_t *data, size_t len) {
+  this->out.write(reinterpret_cast<const char *>(data), len);
+  if (!this->out) {
+    throw Error("Unable to write stream output");
+  }
+}
+
+size_t FdSource::read(uint8_t *buf, size_t len) {
+  for (;;) {
+    const auto n = ::read(this->fd, buf, len);
+    if (n >= 0) {
+      return static_cast<size_t>(n);
+    }
+    if (errno != EINTR) {
+      throw Error(std::string("Unable to read stream input: ") +
+                  strerror(errno));
+    }
+  }
+}
+
+void FdSink::write(const uint8_t *data, size_t len) {
+  while (len > 0) {
+    const auto n = ::write(this->fd, data, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw Error(std::string("Unable to write stream output: ") +
+                  strerror(errno));
+    }
+    data += n;
+    len -= static_cast<size_t>(n);
+  }
+}
+
+// The host context of a Plugin::callStream call
+struct StreamCall {
+  StreamSource &source;
+  StreamSink &sink;
+  // Each chunk is read here and then copied into a block of its exact size,
+  // guests find the length of the chunk from its block
+  std::vector<uint8_t> chunk;
+  // The first error from the source or sink, which ends the stream
+  std::exception_ptr error;
+};
+
+static void streamRead(CurrentPlugin plugin, void *) {
+  auto stream = plugin.hostContext<StreamCall>();
+  plugin.outputVal(0).v.i64 = 0;
+  if (stream == nullptr || stream->error) {
+    return;
+  }
+  size_t n;
+  try {
+    n = stream->source.read(stream->chunk.data(), stream->chunk.size());
+  } catch (...) {
+    stream->error = std::current_exception();
+    return;
+  }
+  if (n == 0) {
+    return;
+  }
+  const auto handle = plugin.memoryAlloc(n);
+  if (handle == 0) {
+    stream->error = std::make_exception_ptr(
+        Error("Unable to allocate plugin memory for stream input"));
+    return;
+  }
+  memcpy(plugin.memory(handle), stream->chunk.data(), n);
+  plugin.outputVal(0).v.i64 = handle;
+}
+
+static void streamWrite(CurrentPlugin plugin, void *) {
+  auto stream = plugin.hostContext<StreamCall>();
+  if (stream == nullptr || stream->error) {
+    return;
+  }
+  try {
+    const auto block = plugin.inputView(0);
+    stream->sink.write(block.data, block.length);
+  } catch (...) {
+    stream->error = std::current_exception();
+  }
+}
+
+std::vector<Function> streamFunctions() {
+  // They hold no state, so every plug-in shares the same pair
+  static const std::vector<Function> functions = {
+      Function("stream_read", {}, {ValType::ExtismValType_I64}, streamRead),
+      Function("stream_write", {ValType::ExtismValType_I64}, {},
+               streamWrite)};
+  return functions;
+}
+
+Buffer Plugin::callStream(const char *func, StreamSource &source,
+                          StreamSink &sink, size_t chunkSize) const {
+  if (chunkSize == 0) {
+    throw Error("Stream chunk size must be greater than zero");
+  }
+  StreamCall stream{source, sink, std::vector<uint8_t>(chunkSize), nullptr};
+  std::optional<Buffer> output;
+  try {
+    output.emplace(this->call(func, "", &stream));
+  } catch (const Error &) {
+    // A guest that fails after its input ended early is reported as the
+    // error that ended it
+    if (stream.error) {
+      std::rethrow_exception(stream.error);
+    }
+    throw;
+  }
+  if (stream.error) {
+    std::rethrow_exception(stream.error);
+  }
+  return *output;
+}
+
+Buffer Plugin::callStream(const std::string &func, StreamSource &source,
+                          StreamSink &sink, size_t chunkSize) const {
+  return this->callStream(func.c_str(), source, sink, chunkSize);
+}
+
+}; // namespace extism
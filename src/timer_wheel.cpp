@@ -0,0 +1,205 @@
+#include "timer_wheel.hpp"
+
+namespace extism {
+
+constexpr std::chrono::milliseconds TimerWheel::tick;
+
+TimerWheel::TimerWheel() : epoch(std::chrono::steady_clock::now()) {
+  std::fill(std::begin(heads), std::end(heads), none);
+  thread = std::thread([this]() { this->run(); });
+}
+
+TimerWheel::~TimerWheel() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+  }
+  changed.notify_one();
+  thread.join();
+}
+
+// Whole ticks from the epoch to `t`
+uint64_t TimerWheel::ticks(std::chrono::steady_clock::time_point t) const {
+  if (t <= epoch) {
+    return 0;
+  }
+  return (t - epoch) / tick;
+}
+
+// File a node in the slot for its expiry, relative to the current tick.
+// `mutex` must be held
+void TimerWheel::link(int32_t index) {
+  auto &node = nodes[index];
+  const uint64_t expiry = std::max(node.expiry, current);
+  size_t level = 0;
+  while (level + 1 < levels &&
+         ((expiry - current) >> (slotBits * (level + 1))) != 0) {
+    level++;
+  }
+  uint64_t slotTick = expiry;
+  // The slot must be ahead of the current one at its level, or it would
+  // only be re-filed after a full turn
+  if (level > 0 && (expiry >> (slotBits * level)) -
+                           (current >> (slotBits * level)) >=
+                       slots) {
+    if (level + 1 < levels) {
+      level++;
+    } else {
+      // Too far away, park it in the last slot of the top level
+      slotTick = current + (uint64_t(slots - 1) << (slotBits * level));
+    }
+  }
+  const size_t slot =
+      level * slots + ((slotTick >> (slotBits * level)) & (slots - 1));
+  node.slot = static_cast<int32_t>(slot);
+  node.prev = none;
+  node.next = heads[slot];
+  if (node.next != none) {
+    nodes[node.next].prev = index;
+  }
+  heads[slot] = index;
+}
+
+// Remove a node from its slot, `mutex` must be held
+void TimerWheel::unlink(int32_t index) {
+  auto &node = nodes[index];
+  if (node.prev != none) {
+    nodes[node.prev].next = node.next;
+  } else {
+    heads[node.slot] = node.next;
+  }
+  if (node.next != none) {
+    nodes[node.next].prev = node.prev;
+  }
+  node.slot = none;
+}
+
+TimerWheel::Timer TimerWheel::add(Deadline deadline, Callback callback,
+                                  void *arg, bool repeat) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (count == 0) {
+    // The wheel is empty and the timer thread may have been asleep for a
+    // while, catch up without stepping through every tick
+    current = std::max(current, ticks(std::chrono::steady_clock::now()));
+  }
+  int32_t index = freeList;
+  if (index == none) {
+    index = static_cast<int32_t>(nodes.size());
+    nodes.emplace_back();
+  } else {
+    freeList = nodes[index].next;
+  }
+  auto &node = nodes[index];
+  // Round up so timers never fire early, a deadline that has already passed
+  // fires on the next tick. Rounding up a deadline near time_point::max()
+  // would overflow, those are far enough away to stay parked
+  const auto rounded = deadline > Deadline::max() - tick
+                           ? deadline
+                           : deadline + tick - std::chrono::nanoseconds(1);
+  node.expiry = std::max(ticks(rounded), current + 1);
+  node.callback = callback;
+  node.arg = arg;
+  node.repeat = repeat;
+  link(index);
+  const Timer timer{static_cast<uint32_t>(index), node.generation};
+  count += 1;
+  const bool first = count == 1;
+  lock.unlock();
+  if (first) {
+    // The timer thread sleeps while there is nothing to do
+    changed.notify_one();
+  }
+  return timer;
+}
+
+bool TimerWheel::remove(Timer timer) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (timer.index >= nodes.size()) {
+    return false;
+  }
+  auto &node = nodes[timer.index];
+  if (node.generation != timer.generation || node.slot == none) {
+    return false;
+  }
+  unlink(static_cast<int32_t>(timer.index));
+  node.generation += 1;
+  node.next = freeList;
+  freeList = static_cast<int32_t>(timer.index);
+  count -= 1;
+  return true;
+}
+
+size_t TimerWheel::pending() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return count;
+}
+
+// Move to the next tick: when levels wrap, the next slot of each level
+// above is re-filed into the lower levels, highest first, then the timers in
+// the current slot of the first level fire. `mutex` must be held
+void TimerWheel::advance() {
+  current += 1;
+  size_t wrapped = 0;
+  while (wrapped + 1 < levels &&
+         (current & ((uint64_t(1) << (slotBits * (wrapped + 1))) - 1)) == 0) {
+    wrapped++;
+  }
+  for (size_t level = wrapped; level > 0; level--) {
+    const size_t slot =
+        level * slots + ((current >> (slotBits * level)) & (slots - 1));
+    int32_t index = heads[slot];
+    heads[slot] = none;
+    while (index != none) {
+      const int32_t next = nodes[index].next;
+      link(index);
+      index = next;
+    }
+  }
+
+  const size_t slot = current & (slots - 1);
+  int32_t index = heads[slot];
+  heads[slot] = none;
+  while (index != none) {
+    auto &node = nodes[index];
+    const int32_t next = node.next;
+    node.slot = none;
+    node.callback(node.arg);
+    if (node.repeat) {
+      // Keeps its handle, so it can still be removed
+      node.expiry = current + 1;
+      link(index);
+      index = next;
+      continue;
+    }
+    node.generation += 1;
+    node.next = freeList;
+    freeList = index;
+    count -= 1;
+    index = next;
+  }
+}
+
+void TimerWheel::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!stop) {
+    const uint64_t now = ticks(std::chrono::steady_clock::now());
+    if (count == 0) {
+      // Nothing is scheduled, so there is nothing to cascade or fire
+      current = std::max(current, now);
+      changed.wait(lock, [this]() { return stop || count > 0; });
+      continue;
+    }
+    while (current < now && count > 0) {
+      advance();
+    }
+    changed.wait_until(lock, epoch + (current + 1) * tick);
+  }
+}
+
+TimerWheel &TimerWheel::shared() {
+  // Never freed, calls may still be running during static destruction
+  static TimerWheel *wheel = new TimerWheel();
+  return *wheel;
+}
+
+}; // namespace extism
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "extism.hpp"
+
+#include <condition_variable>
+#include <thread>
+
+namespace extism {
+
+// A hierarchical timer wheel run by a single thread. Timers are kept in
+// 4 levels of 64 slots with 1ms ticks, so adding and removing a timer is
+// constant time regardless of how many are pending. Timers further away
+// than the top level are parked in its last slot and re-filed as it turns
+class TimerWheel {
+public:
+  typedef void (*Callback)(void *arg);
+
+  struct Timer {
+    uint32_t index;
+    uint32_t generation;
+  };
+
+  TimerWheel();
+  ~TimerWheel();
+  TimerWheel(const TimerWheel &) = delete;
+  TimerWheel &operator=(const TimerWheel &) = delete;
+
+  // Run `callback(arg)` on the timer thread at `deadline`, with a resolution
+  // of one tick. A repeating timer runs it again on every tick after that
+  // until it is removed. Callbacks must be short, they block add and remove
+  Timer add(Deadline deadline, Callback callback, void *arg,
+            bool repeat = false);
+
+  // Remove a timer, returns false if it has already fired and doesn't
+  // repeat. Once this returns its callback is not running and will never run
+  bool remove(Timer timer);
+
+  // Number of timers that haven't fired or been removed
+  size_t pending() const;
+
+  // The timer wheel used for call deadlines, started on first use
+  static TimerWheel &shared();
+
+private:
+  static constexpr size_t levels = 4;
+  static constexpr size_t slotBits = 6;
+  static constexpr size_t slots = 1 << slotBits;
+  static constexpr int32_t none = -1;
+
+  struct Node {
+    uint64_t expiry = 0;
+    Callback callback = nullptr;
+    void *arg = nullptr;
+    int32_t prev = none;
+    int32_t next = none;
+    uint32_t generation = 0;
+    bool repeat = false;
+    // Index into heads while scheduled, none while free
+    int32_t slot = none;
+  };
+
+  const std::chrono::steady_clock::time_point epoch;
+  mutable std::mutex mutex;
+  std::condition_variable changed;
+  std::vector<Node> nodes;
+  int32_t freeList = none;
+  int32_t heads[levels * slots];
+  size_t count = 0;
+  uint64_t current = 0;
+  bool stop = false;
+  std::thread thread;
+
+  static constexpr std::chrono::milliseconds tick{1};
+
+  uint64_t ticks(std::chrono::steady_clock::time_point t) const;
+  void link(int32_t index);
+  void unlink(int32_t index);
+  void advance();
+  void run();
+};
+
+}; // namespace extism
@@ -0,0 +1,39 @@
+#include "extism.hpp"
+
+#include <exception>
+
+namespace extism {
+
+std::atomic<Tracer *> Tracer::active{nullptr};
+
+void Tracer::set(Tracer *tracer) {
+  active.store(tracer, std::memory_order_release);
+}
+
+static thread_local const void *currentContext = nullptr;
+static thread_local uint32_t currentDepth = 0;
+
+TraceContext::TraceContext(const void *context) : previous(currentContext) {
+  currentContext = context;
+}
+
+TraceContext::~TraceContext() { currentContext = this->previous; }
+
+const void *TraceContext::current() { return currentContext; }
+
+void TraceSpan::begin() {
+  this->span.depth = currentDepth++;
+  this->span.context = currentContext;
+  this->exceptions = std::uncaught_exceptions();
+  this->tracer->begin(this->span);
+}
+
+void TraceSpan::end() {
+  currentDepth -= 1;
+  if (std::uncaught_exceptions() > this->exceptions) {
+    this->span.error = true;
+  }
+  this->tracer->end(this->span);
+}
+
+}; // namespace extism
@@ -1,7 +1,18 @@
+#include "../src/base64.hpp"
+#include "../src/chrome_trace.hpp"
+#include "../src/log_ring.hpp"
+#include "../src/metrics.hpp"
+#include "../src/sha256.hpp"
+#include "../src/timer_wheel.hpp"
 #include "../src/extism.hpp"
 
+#include <atomic>
+#include <cstring>
 #include <fstream>
+#include <random>
+#include <sstream>
 #include <thread>
+#include <unistd.h>
 
 #include <gtest/gtest.h>
 
@@ -16,6 +27,585 @@ const std::string code = "../wasm/code.wasm";
 namespace {
 using namespace extism;
 
+TEST(Base64, KnownAnswers) {
+  const std::vector<std::pair<std::string, std::string>> cases = {
+      {"", ""},         {"f", "Zg=="},         {"fo", "Zm8="},
+      {"foo", "Zm9v"},  {"foob", "Zm9vYg=="},  {"fooba", "Zm9vYmE="},
+      {"foobar", "Zm9vYmFy"}};
+  for (const auto &c : cases) {
+    ASSERT_EQ(base64_encode(reinterpret_cast<const uint8_t *>(c.first.data()),
+                            c.first.size()),
+              c.second);
+  }
+}
+
+TEST(Base64, EncodersMatchScalar) {
+  std::mt19937 rng(0);
+  std::vector<uint8_t> data(4096);
+  for (auto &b : data) {
+    b = static_cast<uint8_t>(rng());
+  }
+  // Every pair of byte values, so each 6-bit index appears in every position
+  for (int i = 0; i < 256; i++) {
+    for (int j = 0; j < 256; j++) {
+      data.push_back(i);
+      data.push_back(j);
+      data.push_back(i ^ j);
+    }
+  }
+
+  auto check = [](const uint8_t *src, size_t len) {
+    std::string expected(base64_encoded_length(len), '\0');
+    base64_encode_scalar(src, len, expected.data());
+    for (const auto &encoder : base64_encoders()) {
+      std::string out(expected.size(), '\0');
+      encoder.second(src, len, out.data());
+      ASSERT_EQ(out, expected) << encoder.first << " length " << len;
+    }
+  };
+
+  // Every length and alignment up to a few vector blocks
+  for (size_t len = 0; len <= 256; len++) {
+    for (size_t offset = 0; offset < 4; offset++) {
+      check(data.data() + offset, len);
+    }
+  }
+  check(data.data(), data.size());
+}
+
+TEST(Sha256, KnownAnswers) {
+  const std::vector<std::pair<std::string, std::string>> cases = {
+      {"", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"},
+      {"abc",
+       "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"},
+      {"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+       "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"},
+      {std::string(1000000, 'a'),
+       "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0"}};
+  for (const auto &c : cases) {
+    const auto data = reinterpret_cast<const uint8_t *>(c.first.data());
+    ASSERT_EQ(sha256_hex(data, c.first.size()), c.second);
+    for (const auto &compressor : sha256_compressors()) {
+      uint8_t digest[sha256_length];
+      sha256(compressor.second, data, c.first.size(), digest);
+      std::string hex;
+      for (uint8_t b : digest) {
+        char byte[3];
+        snprintf(byte, sizeof(byte), "%02x", b);
+        hex += byte;
+      }
+      ASSERT_EQ(hex, c.second) << compressor.first;
+    }
+  }
+  ASSERT_TRUE(sha256_is_hex(cases[0].second));
+  ASSERT_FALSE(sha256_is_hex("../" + cases[0].second.substr(3)));
+}
+
+TEST(Sha256, CompressorsMatchScalar) {
+  std::mt19937 rng(0);
+  std::vector<uint8_t> data(1 << 16);
+  for (auto &b : data) {
+    b = static_cast<uint8_t>(rng());
+  }
+
+  auto check = [](const uint8_t *src, size_t len) {
+    uint8_t expected[sha256_length];
+    sha256(sha256_compress_scalar, src, len, expected);
+    for (const auto &compressor : sha256_compressors()) {
+      uint8_t digest[sha256_length];
+      sha256(compressor.second, src, len, digest);
+      ASSERT_EQ(memcmp(digest, expected, sizeof(digest)), 0)
+          << compressor.first << " length " << len;
+    }
+  };
+
+  // Every length around the padding boundaries of a few blocks
+  for (size_t len = 0; len <= 256; len++) {
+    for (size_t offset = 0; offset < 4; offset++) {
+      check(data.data() + offset, len);
+    }
+  }
+  check(data.data(), data.size());
+}
+
+TEST(Manifest, ComputeHashes) {
+  auto wasm = read(code.c_str());
+  const auto hash = sha256_hex(wasm.data(), wasm.size());
+  const std::vector<uint8_t> other(100, 1);
+  const auto otherHash = sha256_hex(other.data(), other.size());
+
+  ASSERT_EQ(Manifest({Wasm::bytes(wasm, autoHash)}).json(),
+            Manifest::wasmBytes(wasm, hash).json());
+
+  Manifest manifest;
+  manifest.addWasmBytes(other, "");
+  manifest.addWasmPath(code);
+  manifest.addWasmPath(code, "abc");
+  manifest.addWasmURL("https://example.com/x.wasm");
+  for (int i = 0; i < 8; i++) {
+    manifest.addWasm(Wasm::bytes(wasm));
+  }
+  manifest.computeHashes();
+
+  Manifest expected;
+  expected.addWasmBytes(other, otherHash);
+  expected.addWasmPath(code, hash);
+  expected.addWasmPath(code, "abc");
+  expected.addWasmURL("https://example.com/x.wasm");
+  for (int i = 0; i < 8; i++) {
+    expected.addWasm(Wasm::bytes(wasm, hash));
+  }
+  ASSERT_EQ(manifest.json(), expected.json());
+
+  manifest.addWasmPath("missing.wasm");
+  ASSERT_THROW(manifest.computeHashes(), Error);
+
+  // Copies remember the hash instead of hashing again
+  std::vector<uint8_t> buffer(other);
+  auto bytes = WasmBytes::CreateWithoutOwnership(buffer.data(), 100);
+  ASSERT_EQ(bytes.sha256(), otherHash);
+  buffer[0] = 2;
+  auto copy = bytes;
+  ASSERT_EQ(copy.sha256(), otherHash);
+  ASSERT_NE(WasmBytes::CreateWithoutOwnership(buffer.data(), 100).sha256(),
+            otherHash);
+}
+
+TEST(Manifest, Json) {
+  const uint8_t bytes[] = {0, 1, 2, 3, 4};
+  Manifest manifest;
+  manifest.addWasmPath("/tmp/a \"b\".wasm", "abc");
+  manifest.addWasm(Wasm::url("https://example.com/x.wasm", "", "POST",
+                             {{"X-Key", "caf\xc3\xa9\n"}}));
+  manifest.addWasmBytes(bytes, sizeof(bytes));
+  manifest.allowHost("example.com");
+  manifest.allowPath("/tmp");
+  manifest.setConfig("k", "v\x01");
+  manifest.setTimeout(1000);
+
+  const std::string expected =
+      "{\"allowed_hosts\":[\"example.com\"],"
+      "\"allowed_paths\":{\"/tmp\":\"/tmp\"},"
+      "\"config\":{\"k\":\"v\\u0001\"},"
+      "\"timeout_ms\":1000,"
+      "\"wasm\":[{\"hash\":\"abc\",\"path\":\"/tmp/a \\\"b\\\".wasm\"},"
+      "{\"headers\":{\"X-Key\":\"caf\\u00e9\\n\"},\"method\":\"POST\","
+      "\"url\":\"https://example.com/x.wasm\"},"
+      "{\"data\":\"AAECAwQ=\"}]}\n";
+  ASSERT_EQ(manifest.json(), expected);
+
+  std::string streamed;
+  manifest.json([&streamed](std::string_view s) { streamed.append(s); });
+  ASSERT_EQ(streamed, expected);
+
+  ASSERT_EQ(Manifest().json(), "{\"wasm\":null}\n");
+}
+
+TEST(Manifest, JsonLargeModule) {
+  std::vector<uint8_t> data(1 << 20);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = static_cast<uint8_t>(i);
+  }
+  auto manifest = Manifest::wasmBytes(data, "");
+
+  std::string streamed;
+  size_t chunks = 0;
+  manifest.json([&](std::string_view s) {
+    streamed.append(s);
+    chunks += 1;
+  });
+  ASSERT_GT(chunks, 1);
+  ASSERT_EQ(streamed, manifest.json());
+  ASSERT_EQ(streamed, "{\"wasm\":[{\"data\":\"" +
+                          base64_encode(data.data(), data.size()) +
+                          "\"}]}\n");
+}
+
+TEST(Manifest, MappedFile) {
+  auto wasm = read(code.c_str());
+  auto bytes = WasmBytes::mapFile(code);
+  ASSERT_EQ(std::vector<uint8_t>(bytes.get(), bytes.get() + bytes.getSize()),
+            wasm);
+
+  // Copies share the mapping, which is passed to libextism by pointer
+  Manifest manifest({Wasm(bytes)});
+  char expected[128];
+  snprintf(expected, sizeof(expected),
+           "{\"wasm\":[{\"data\":{\"len\":%zu,\"ptr\":%llu}}]}\n",
+           wasm.size(), (unsigned long long)(uintptr_t)bytes.get());
+  ASSERT_EQ(manifest.json(false), expected);
+  ASSERT_EQ(Manifest({Wasm::mmap(code)}).json(),
+            Manifest::wasmBytes(wasm, "").json());
+
+  ASSERT_THROW(WasmBytes::mapFile("missing.wasm"), Error);
+}
+
+// An empty directory for a module cache test
+std::filesystem::path cacheDirectory(const std::string &name) {
+  auto path = std::filesystem::temp_directory_path() /
+              ("extism-cpp-test-" + name + "-" + std::to_string(getpid()));
+  std::filesystem::remove_all(path);
+  return path;
+}
+
+TEST(ModuleCache, PutGet) {
+  const auto dir = cacheDirectory("put-get");
+  ModuleCache cache(dir);
+  auto wasm = read(code.c_str());
+  const auto hash = cache.put(wasm);
+  ASSERT_EQ(hash, sha256_hex(wasm.data(), wasm.size()));
+  ASSERT_EQ(cache.put(wasm), hash);
+  ASSERT_EQ(cache.size(), wasm.size());
+
+  auto cached = cache.get(hash);
+  ASSERT_TRUE(cached.has_value());
+  ASSERT_EQ(std::vector<uint8_t>(cached->get(),
+                                 cached->get() + cached->getSize()),
+            wasm);
+
+  // Another cache on the same directory, like another process
+  ModuleCache other(dir);
+  ASSERT_TRUE(other.get(hash).has_value());
+
+  ASSERT_FALSE(cache.get(std::string(64, '0')).has_value());
+  ASSERT_FALSE(cache.get("../modules").has_value());
+  ASSERT_EQ(cache.stats().hits, 1);
+  ASSERT_EQ(cache.stats().misses, 2);
+  std::filesystem::remove_all(dir);
+}
+
+TEST(ModuleCache, Corrupted) {
+  const auto dir = cacheDirectory("corrupted");
+  ModuleCache cache(dir);
+  const std::vector<uint8_t> data(1000, 7);
+  const auto hash = cache.put(data);
+  const auto entry = dir / "modules" / (hash + ".wasm");
+  std::filesystem::resize_file(entry, 10);
+
+  ASSERT_FALSE(cache.get(hash).has_value());
+  ASSERT_EQ(cache.stats().corrupted, 1);
+  ASSERT_FALSE(std::filesystem::exists(entry));
+
+  cache.put(data);
+  ASSERT_TRUE(cache.get(hash).has_value());
+
+  // Replaced by a file of the same size, which is a new inode
+  const auto replacement = dir / "replacement";
+  std::ofstream(replacement, std::ios::binary) << std::string(1000, 8);
+  std::filesystem::rename(replacement, entry);
+  ASSERT_FALSE(cache.get(hash).has_value());
+  ASSERT_EQ(cache.stats().corrupted, 2);
+  std::filesystem::remove_all(dir);
+}
+
+TEST(ModuleCache, Trim) {
+  const auto dir = cacheDirectory("trim");
+  ModuleCache cache(dir, 2500);
+  const auto a = cache.put(std::vector<uint8_t>(1000, 'a'));
+  const auto b = cache.put(std::vector<uint8_t>(1000, 'b'));
+  ASSERT_TRUE(cache.get(a).has_value());
+
+  // Left behind by a writer that died
+  std::ofstream(dir / "modules" / (b + ".wasm.tmp.1")) << "partial";
+
+  // b is the least recently used
+  const auto c = cache.put(std::vector<uint8_t>(1000, 'c'));
+  ASSERT_TRUE(cache.get(a).has_value());
+  ASSERT_FALSE(cache.get(b).has_value());
+  ASSERT_TRUE(cache.get(c).has_value());
+  ASSERT_EQ(cache.stats().evicted, 1);
+  ASSERT_EQ(cache.size(), 2000);
+  ASSERT_EQ(std::distance(std::filesystem::directory_iterator(dir / "modules"),
+                          std::filesystem::directory_iterator()),
+            2);
+  std::filesystem::remove_all(dir);
+}
+
+TEST(ModuleCache, Resolve) {
+  const auto dir = cacheDirectory("resolve");
+  auto cache = std::make_shared<ModuleCache>(dir);
+  auto wasm = read(code.c_str());
+  const auto hash = sha256_hex(wasm.data(), wasm.size());
+  const auto expected = "{\"wasm\":[{\"data\":\"" +
+                        base64_encode(wasm.data(), wasm.size()) +
+                        "\",\"hash\":\"" + hash + "\"}]}\n";
+
+  // A URL module that misses is left to libextism, one that hits isn't
+  // downloaded
+  auto manifest = Manifest::wasmURL("https://example.invalid/code.wasm", hash);
+  ASSERT_EQ(cache->resolve(manifest).json(), manifest.json());
+  ASSERT_EQ(cache->stats().misses, 1);
+  cache->put(wasm);
+  ASSERT_EQ(cache->resolve(manifest).json(), expected);
+  ASSERT_EQ(cache->stats().hits, 1);
+
+  // Path and bytes modules are already local
+  manifest = Manifest::wasmPath(code, hash);
+  ASSERT_EQ(cache->resolve(manifest).json(), manifest.json());
+  std::vector<uint8_t> other(100, 1);
+  manifest = Manifest::wasmBytes(other, sha256_hex(other.data(), 100));
+  ASSERT_EQ(cache->resolve(manifest).json(), manifest.json());
+  ASSERT_EQ(cache->size(), wasm.size());
+
+  // Modules without a hash are left alone
+  manifest = Manifest::wasmURL("https://example.invalid/code.wasm");
+  ASSERT_EQ(cache->resolve(manifest).json(), manifest.json());
+  ASSERT_EQ(cache->stats().hits + cache->stats().misses, 2);
+  std::filesystem::remove_all(dir);
+}
+
+TEST(Metrics, LatencyHistogram) {
+  for (uint64_t v : std::vector<uint64_t>{0, 1, 7, 8, 9, 1000, 123456789,
+                                          UINT64_MAX}) {
+    const size_t bucket = LatencyHistogram::bucket(v);
+    ASSERT_LT(bucket, LatencyHistogram::bucketCount);
+    ASSERT_LE(LatencyHistogram::bucketLowerBound(bucket), v);
+    if (bucket + 1 < LatencyHistogram::bucketCount) {
+      ASSERT_GT(LatencyHistogram::bucketLowerBound(bucket + 1), v);
+    }
+  }
+
+  LatencyHistogram h;
+  for (uint64_t v = 1; v <= 1000; v++) {
+    h.counts[LatencyHistogram::bucket(v * 1000)] += 1;
+    h.count += 1;
+  }
+  // Within the 12.5% bucket width of the exact value
+  ASSERT_GE(h.quantile(0.5), 500000);
+  ASSERT_LE(h.quantile(0.5), 500000 * 1.125);
+  ASSERT_GE(h.quantile(0.99), 990000);
+  ASSERT_LE(h.quantile(0.99), 990000 * 1.125);
+}
+
+TEST(Metrics, PrometheusText) {
+  MetricsSnapshot metrics;
+  auto &call = metrics.exports["count_vowels"];
+  call.calls = 3;
+  call.errors = 1;
+  call.inputBytes = 10;
+  call.latency.counts[LatencyHistogram::bucket(2000)] = 3;
+  call.latency.count = 3;
+  call.latency.sum = 6000;
+  metrics.hostFunctions["say \"hi\""].calls = 1;
+
+  auto text = prometheusText(metrics, "plugin=\"test\"");
+  ASSERT_NE(text.find("# TYPE extism_export_calls_total counter\n"
+                      "extism_export_calls_total{plugin=\"test\","
+                      "export=\"count_vowels\"} 3\n"),
+            std::string::npos);
+  ASSERT_NE(text.find("extism_export_duration_seconds_bucket{plugin=\"test\","
+                      "export=\"count_vowels\",le=\"1.024e-06\"} 0\n"),
+            std::string::npos);
+  ASSERT_NE(text.find("extism_export_duration_seconds_bucket{plugin=\"test\","
+                      "export=\"count_vowels\",le=\"2.048e-06\"} 3\n"),
+            std::string::npos);
+  ASSERT_NE(text.find("extism_export_duration_seconds_count{plugin=\"test\","
+                      "export=\"count_vowels\"} 3\n"),
+            std::string::npos);
+  ASSERT_NE(text.find("extism_host_function_calls_total{plugin=\"test\","
+                      "function=\"say \\\"hi\\\"\"} 1\n"),
+            std::string::npos);
+}
+
+class RecordingTracer : public Tracer {
+public:
+  std::vector<std::pair<char, Span>> spans;
+  void begin(const Span &span) override { spans.emplace_back('B', span); }
+  void end(const Span &span) override { spans.emplace_back('E', span); }
+};
+
+TEST(Tracer, Spans) {
+  RecordingTracer tracer;
+  Tracer::set(&tracer);
+  int request = 0;
+  {
+    TraceContext context(&request);
+    TraceSpan call(Span::Kind::Call, "count_vowels", 3);
+    call.output(10);
+    try {
+      TraceSpan host(Span::Kind::HostFunction, "hello_world");
+      throw Error("failed");
+    } catch (const Error &) {
+    }
+  }
+  Tracer::set(nullptr);
+  { TraceSpan ignored(Span::Kind::Reset, ""); }
+
+  ASSERT_EQ(tracer.spans.size(), 4);
+  ASSERT_EQ(tracer.spans[0].second.name, "count_vowels");
+  ASSERT_EQ(tracer.spans[0].second.context, &request);
+  ASSERT_EQ(tracer.spans[1].second.depth, 1);
+  ASSERT_EQ(tracer.spans[2].first, 'E');
+  ASSERT_TRUE(tracer.spans[2].second.error);
+  ASSERT_EQ(tracer.spans[3].second.outputBytes, 10);
+  ASSERT_FALSE(tracer.spans[3].second.error);
+  ASSERT_EQ(tracer.spans[3].second.depth, 0);
+}
+
+TEST(Tracer, ChromeTrace) {
+  ChromeTracer tracer;
+  Tracer::set(&tracer);
+  {
+    TraceSpan call(Span::Kind::Call, "say \"hi\"", 3);
+    call.output(5);
+  }
+  Tracer::set(nullptr);
+
+  std::stringstream out;
+  tracer.write(out);
+  auto json = out.str();
+  ASSERT_EQ(json.find("{\"traceEvents\":[{\"name\":\"say \\\"hi\\\"\","
+                      "\"cat\":\"call\",\"ph\":\"B\""),
+            0);
+  ASSERT_NE(json.find("\"ph\":\"E\""), std::string::npos);
+  ASSERT_NE(json.find("\"output_bytes\":5,\"error\":false"),
+            std::string::npos);
+}
+
+TEST(TimerWheel, Fires) {
+  struct Timer {
+    Deadline deadline;
+    std::atomic<int> fired{0};
+    bool early = false;
+  };
+  TimerWheel wheel;
+  const auto now = std::chrono::steady_clock::now();
+  // Spread over several turns of the first level, with some far away
+  std::vector<Timer> timers(10000);
+  std::vector<TimerWheel::Timer> handles;
+  for (size_t i = 0; i < timers.size(); i++) {
+    timers[i].deadline =
+        now + (i % 10 == 0 ? std::chrono::hours(24)
+                           : std::chrono::milliseconds(50 + i % 300));
+    handles.push_back(wheel.add(
+        timers[i].deadline,
+        [](void *arg) {
+          auto timer = static_cast<Timer *>(arg);
+          timer->early = std::chrono::steady_clock::now() < timer->deadline;
+          timer->fired += 1;
+        },
+        &timers[i]));
+  }
+  // Remove every other one of the near timers
+  for (size_t i = 1; i < timers.size(); i += 20) {
+    ASSERT_TRUE(wheel.remove(handles[i]));
+  }
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  for (size_t i = 0; i < timers.size(); i++) {
+    const bool removed = i % 20 == 1;
+    const bool far = i % 10 == 0;
+    ASSERT_EQ(timers[i].fired, removed || far ? 0 : 1) << i;
+    ASSERT_FALSE(timers[i].early) << i;
+  }
+  ASSERT_EQ(wheel.pending(), 1000);
+  for (size_t i = 0; i < timers.size(); i += 10) {
+    ASSERT_TRUE(wheel.remove(handles[i]));
+  }
+  ASSERT_FALSE(wheel.remove(handles[2]));
+  ASSERT_EQ(wheel.pending(), 0);
+}
+
+TEST(TimerWheel, MaxDeadline) {
+  TimerWheel wheel;
+  std::atomic<int> fired{0};
+  const auto timer = wheel.add(
+      Deadline::max(),
+      [](void *arg) { *static_cast<std::atomic<int> *>(arg) += 1; }, &fired);
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  ASSERT_EQ(fired, 0);
+  ASSERT_TRUE(wheel.remove(timer));
+}
+
+TEST(TimerWheel, Repeats) {
+  TimerWheel wheel;
+  std::atomic<int> fired{0};
+  const auto timer = wheel.add(
+      std::chrono::steady_clock::now(),
+      [](void *arg) { *static_cast<std::atomic<int> *>(arg) += 1; }, &fired,
+      true);
+  while (fired < 3) {
+    std::this_thread::yield();
+  }
+  ASSERT_EQ(wheel.pending(), 1);
+  ASSERT_TRUE(wheel.remove(timer));
+  const int count = fired;
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  ASSERT_EQ(fired, count);
+  ASSERT_EQ(wheel.pending(), 0);
+}
+
+TEST(LogRing, Bounded) {
+  LogRing<std::string> ring(3);
+  ASSERT_EQ(ring.capacity(), 4);
+  for (int i = 0; i < 4; i++) {
+    std::string line = std::to_string(i);
+    ASSERT_TRUE(ring.push(line));
+  }
+  std::string extra = "4";
+  ASSERT_FALSE(ring.push(extra));
+  ASSERT_EQ(extra, "4");
+
+  std::string line;
+  ASSERT_TRUE(ring.pop(line));
+  ASSERT_EQ(line, "0");
+  ASSERT_TRUE(ring.push(extra));
+  for (int i = 1; i <= 4; i++) {
+    ASSERT_TRUE(ring.pop(line));
+    ASSERT_EQ(line, std::to_string(i));
+  }
+  ASSERT_FALSE(ring.pop(line));
+}
+
+TEST(LogRing, Threads) {
+  LogRing<std::string> ring(64);
+  const size_t count = 200000;
+  std::thread producer([&]() {
+    for (size_t i = 0; i < count; i++) {
+      std::string line = std::to_string(i);
+      while (!ring.push(line)) {
+        std::this_thread::yield();
+      }
+    }
+  });
+  std::string line;
+  for (size_t i = 0; i < count; i++) {
+    while (!ring.pop(line)) {
+      std::this_thread::yield();
+    }
+    ASSERT_EQ(line, std::to_string(i));
+  }
+  producer.join();
+  ASSERT_FALSE(ring.pop(line));
+}
+
+TEST(Stream, Adapters) {
+  std::istringstream in("hello, world");
+  IstreamSource source(in);
+  uint8_t buf[8];
+  ASSERT_EQ(source.read(buf, sizeof(buf)), 8);
+  ASSERT_EQ(std::string(reinterpret_cast<char *>(buf), 8), "hello, w");
+  ASSERT_EQ(source.read(buf, sizeof(buf)), 4);
+  ASSERT_EQ(source.read(buf, sizeof(buf)), 0);
+
+  std::ostringstream out;
+  OstreamSink sink(out);
+  sink.write(reinterpret_cast<const uint8_t *>("abc"), 3);
+  ASSERT_EQ(out.str(), "abc");
+
+  int fds[2];
+  ASSERT_EQ(pipe(fds), 0);
+  FdSink fdSink(fds[1]);
+  fdSink.write(reinterpret_cast<const uint8_t *>("pipe"), 4);
+  close(fds[1]);
+  FdSource fdSource(fds[0]);
+  ASSERT_EQ(fdSource.read(buf, sizeof(buf)), 4);
+  ASSERT_EQ(std::string(reinterpret_cast<char *>(buf), 4), "pipe");
+  ASSERT_EQ(fdSource.read(buf, sizeof(buf)), 0);
+  close(fds[0]);
+  ASSERT_THROW(fdSource.read(buf, sizeof(buf)), Error);
+}
+
 TEST(Plugin, Manifest) {
   Manifest manifest = Manifest::wasmPath(code);
   manifest.setConfig("a", "1");
@@ -47,6 +637,34 @@ TEST(Plugin, Bytes) {
   ASSERT_TRUE(buf.string().find("\"count\":6") != std::string::npos);
 }
 
+TEST(Plugin, MappedFile) {
+  auto wasm = Wasm::mmap(code);
+  Plugin plugin(Manifest({wasm}));
+  Buffer buf = plugin.call("count_vowels", "this is a test");
+  ASSERT_TRUE(buf.string().find("\"count\":4") != std::string::npos);
+
+  PluginPool pool(Manifest({wasm}), false, {}, 2);
+  ASSERT_TRUE(pool.acquire()->functionExists("count_vowels"));
+}
+
+TEST(Plugin, ModuleCache) {
+  const auto dir = cacheDirectory("plugin");
+  auto cache = std::make_shared<ModuleCache>(dir);
+  auto wasm = read(code.c_str());
+  // Only found in the cache, the URL is never fetched
+  auto manifest = Manifest::wasmURL("https://example.invalid/code.wasm",
+                                    cache->put(wasm));
+  manifest.setModuleCache(cache);
+  for (int i = 0; i < 2; i++) {
+    Plugin plugin(manifest);
+    Buffer buf = plugin.call("count_vowels", "this is a test");
+    ASSERT_TRUE(buf.string().find("\"count\":4") != std::string::npos);
+  }
+  CompiledPlugin compiled(manifest);
+  ASSERT_EQ(cache->stats().hits, 2);
+  std::filesystem::remove_all(dir);
+}
+
 TEST(Plugin, UpdateConfig) {
   auto wasm = read(code.c_str());
   Plugin plugin(wasm);
@@ -56,6 +674,32 @@ TEST(Plugin, UpdateConfig) {
   ASSERT_NO_THROW(plugin.config(config));
 }
 
+TEST(Plugin, ConfigBlob) {
+  Config config;
+  config["a"] = "1";
+  config["b"] = "2";
+  ConfigBlob first(config);
+  ASSERT_EQ(first.json(), "{\"a\":\"1\",\"b\":\"2\"}");
+
+  ConfigBlob second = first.with({{"b", "3"}, {"c", "4"}});
+  ASSERT_EQ(second.json(), "{\"a\":\"1\",\"b\":\"3\",\"c\":\"4\"}");
+
+  ConfigBlob third = second.with({{"a", std::nullopt}});
+  ASSERT_EQ(third.json(), "{\"a\":null,\"b\":\"3\",\"c\":\"4\"}");
+  ASSERT_EQ(third.changedSince(first).json(),
+            "{\"a\":null,\"b\":\"3\",\"c\":\"4\"}");
+  ASSERT_EQ(third.changedSince(third).json(), "{}");
+  ASSERT_EQ(ConfigBlob(config).changedSince(second).json(),
+            "{\"b\":\"2\",\"c\":null}");
+
+  auto wasm = read(code.c_str());
+  Plugin a(wasm);
+  Plugin b(wasm);
+  ASSERT_NO_THROW(a.config(second));
+  ASSERT_NO_THROW(b.config(second));
+  ASSERT_NO_THROW(b.config(third.changedSince(second)));
+}
+
 TEST(Plugin, FunctionExists) {
   auto wasm = read(code.c_str());
   Plugin plugin(wasm);
@@ -80,6 +724,313 @@ TEST(Plugin, HostFunction) {
   ASSERT_EQ((std::string)buf, "test");
 }
 
+TEST(Plugin, HostFunctionTable) {
+  auto wasm = read("../wasm/code-functions.wasm");
+  auto t = std::vector<ValType>{ValType::ExtismValType_I64};
+  std::atomic<int> calls{0};
+  std::atomic<int> freed{0};
+  std::vector<Function> functions;
+  {
+    // Built once, the table can go away before the plugins using it
+    HostFunctionTable table;
+    table.add(
+        "hello_world", t, t,
+        [](CurrentPlugin plugin, void *userData) {
+          (*static_cast<std::atomic<int> *>(userData))++;
+          plugin.output(std::string("test"));
+        },
+        &calls, [&freed](void *) { freed++; });
+    ASSERT_EQ(table.size(), 1);
+    functions = table.functions();
+  }
+
+  std::vector<Plugin> plugins;
+  for (int i = 0; i < 4; i++) {
+    plugins.emplace_back(wasm, true, functions);
+  }
+  CompiledPlugin compiled(wasm, true, functions);
+  plugins.push_back(compiled.instantiate());
+  PluginPool pool(compiled, 2);
+  for (auto &plugin : plugins) {
+    ASSERT_EQ((std::string)plugin.call("count_vowels", "aaa"), "test");
+  }
+  ASSERT_EQ((std::string)pool.acquire().call("count_vowels", "aaa"), "test");
+  ASSERT_EQ(calls, 6);
+
+  plugins.clear();
+  functions.clear();
+  ASSERT_EQ(freed, 0);
+}
+
+TEST(Plugin, HostContext) {
+  auto wasm = read("../wasm/code-functions.wasm");
+  auto t = std::vector<ValType>{ValType::ExtismValType_I64};
+  // One set of functions, each call brings its own context
+  CompiledPlugin compiled(
+      wasm, true,
+      {Function("hello_world", t, t, [](CurrentPlugin plugin, void *) {
+        auto tenant = plugin.hostContext<const std::string>();
+        plugin.output(tenant == nullptr ? "none" : *tenant);
+      })});
+
+  std::vector<std::thread> threads;
+  std::atomic<int> matched{0};
+  for (int i = 0; i < 4; i++) {
+    threads.emplace_back([&compiled, &matched, i]() {
+      auto plugin = compiled.instantiate();
+      std::string tenant = "tenant-" + std::to_string(i);
+      for (int j = 0; j < 100; j++) {
+        auto out = plugin.call("count_vowels", "aaa", &tenant);
+        matched += out.string() == tenant;
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  ASSERT_EQ(matched, 400);
+
+  auto plugin = compiled.instantiate();
+  ASSERT_EQ(plugin.call("count_vowels", "aaa").string(), "none");
+}
+
+static std::string typedHelloWorld(std::string_view input) {
+  return "hello " + std::string(input);
+}
+
+TEST(Plugin, TypedHostFunction) {
+  auto wasm = read("../wasm/code-functions.wasm");
+  Plugin a(wasm, true, {Function::make<&typedHelloWorld>("hello_world")});
+  ASSERT_EQ(a.call("count_vowels", "aaa").string(), "hello aaa");
+
+  std::string prefix = "test ";
+  Plugin b(wasm, true,
+           {Function::make("hello_world",
+                           [prefix](const CurrentPlugin &plugin,
+                                    std::string_view input) {
+                             return prefix + std::string(input);
+                           })});
+  ASSERT_EQ(b.call("count_vowels", "aaa").string(), "test aaa");
+}
+
+TEST(Plugin, OutputWriter) {
+  auto wasm = read("../wasm/code-functions.wasm");
+  auto t = std::vector<ValType>{ValType::ExtismValType_I64};
+  Function hello_world =
+      Function("hello_world", t, t, [](CurrentPlugin plugin, void *user_data) {
+        auto input = plugin.inputView();
+        ASSERT_THROW(input.subview(1, input.length), Error);
+        OutputWriter out(plugin, 4);
+        out.write("testing");
+        memcpy(out.prepare(input.length), input.data, input.length);
+        out.reserve(1024);
+        out.commit();
+      });
+  Plugin plugin(wasm, true, {hello_world});
+  ASSERT_EQ(plugin.call("count_vowels", "123").string(), "testing123");
+}
+
+#ifdef EXTISM_CPP_METRICS
+TEST(Plugin, Metrics) {
+  auto wasm = read("../wasm/code-functions.wasm");
+  Plugin plugin(wasm, true,
+                {Function::make("hello_world",
+                                [](std::string_view input) { return input; })});
+  plugin.call("count_vowels", "aaa");
+  plugin.call("count_vowels", "aaaa");
+  ASSERT_THROW(plugin.call("missing"), Error);
+
+  auto metrics = plugin.metrics();
+  const auto &call = metrics.exports["count_vowels"];
+  ASSERT_EQ(call.calls, 2);
+  ASSERT_EQ(call.errors, 0);
+  ASSERT_EQ(call.inputBytes, 7);
+  ASSERT_EQ(call.outputBytes, 7);
+  ASSERT_EQ(call.latency.count, 2);
+  ASSERT_EQ(metrics.exports["missing"].errors, 1);
+  ASSERT_EQ(metrics.hostFunctions["hello_world"].calls, 2);
+}
+#endif
+
+#ifdef EXTISM_CPP_METRICS
+TEST(Metrics, ShardsPerThread) {
+  // More plugins than a thread caches, each keeps one shard for the thread
+  std::vector<std::unique_ptr<PluginMetrics>> plugins;
+  for (int i = 0; i < 40; i++) {
+    plugins.push_back(std::make_unique<PluginMetrics>());
+  }
+  for (int round = 0; round < 10; round++) {
+    for (auto &metrics : plugins) {
+      metrics->recordCall("count_vowels", 1000, true, 1, 1);
+    }
+  }
+  std::thread([&]() {
+    plugins[0]->recordCall("count_vowels", 1000, true, 1, 1);
+  }).join();
+
+  ASSERT_EQ(plugins[0]->shardCount(), 2);
+  for (size_t i = 1; i < plugins.size(); i++) {
+    ASSERT_EQ(plugins[i]->shardCount(), 1);
+    ASSERT_EQ(plugins[i]->snapshot().exports["count_vowels"].calls, 10);
+  }
+  ASSERT_EQ(plugins[0]->snapshot().exports["count_vowels"].calls, 11);
+}
+#endif
+
+TEST(Plugin, Tracer) {
+  auto wasm = read("../wasm/code-functions.wasm");
+  Plugin plugin(wasm, true,
+                {Function::make("hello_world",
+                                [](std::string_view input) { return input; })});
+  RecordingTracer tracer;
+  Tracer::set(&tracer);
+  plugin.call("count_vowels", "aaa");
+  plugin.reset();
+  Tracer::set(nullptr);
+
+  ASSERT_EQ(tracer.spans.size(), 6);
+  ASSERT_EQ(tracer.spans[0].second.kind, Span::Kind::Call);
+  ASSERT_EQ(tracer.spans[1].second.kind, Span::Kind::HostFunction);
+  ASSERT_EQ(tracer.spans[1].second.name, "hello_world");
+  ASSERT_EQ(tracer.spans[1].second.depth, 1);
+  ASSERT_EQ(tracer.spans[3].second.outputBytes, 3);
+  ASSERT_EQ(tracer.spans[4].second.kind, Span::Kind::Reset);
+}
+
+TEST(Plugin, TracerAsyncContext) {
+  Plugin plugin(Manifest::wasmPath(code));
+  PluginPool pool(Manifest::wasmPath(code), false, {}, 1);
+  auto pipeline = Pipeline::Builder().stage(pool, "count_vowels").build();
+  // Only the calls are traced, not creating the instance
+  pool.prewarm(1);
+  RecordingTracer tracer;
+  Tracer::set(&tracer);
+  int request = 0;
+  {
+    // One call at a time, the recording tracer isn't thread-safe
+    TraceContext context(&request);
+    plugin.callAsync("count_vowels", "aaa").get();
+    pool.callAsync("count_vowels", "aaa").get();
+    pipeline.submit("aaa").get();
+  }
+  Tracer::set(nullptr);
+
+  ASSERT_EQ(tracer.spans.size(), 6);
+  for (const auto &span : tracer.spans) {
+    ASSERT_EQ(span.second.kind, Span::Kind::Call);
+    ASSERT_EQ(span.second.context, &request);
+  }
+}
+
+TEST(Plugin, LogCallback) {
+  std::mutex mutex;
+  std::vector<std::string> lines;
+  ASSERT_TRUE(
+      setLogCallback("trace", [&](const std::vector<std::string> &batch) {
+        std::lock_guard<std::mutex> lock(mutex);
+        lines.insert(lines.end(), batch.begin(), batch.end());
+      }));
+  {
+    Plugin plugin(Manifest::wasmPath(code));
+    plugin.call("count_vowels", "aaa");
+  }
+  flushLogs();
+
+  std::lock_guard<std::mutex> lock(mutex);
+  ASSERT_FALSE(lines.empty());
+  const auto stats = logStats();
+  // The collector may already have picked up more since the flush
+  ASSERT_GE(stats.lines - stats.dropped, lines.size());
+  ASSERT_TRUE(setLogCallback("trace", nullptr));
+}
+
+// Copies its input to its output a chunk at a time:
+//   (import "extism:host/user" "stream_read" (func $read (result i64)))
+//   (import "extism:host/user" "stream_write" (func $write (param i64)))
+//   (import "extism:host/env" "free" (func $free (param i64)))
+//   (func (export "copy") (result i32) (local $h i64)
+//     (block $done (loop $next
+//       (br_if $done (i64.eqz (local.tee $h (call $read))))
+//       (call $write (local.get $h))
+//       (call $free (local.get $h))
+//       (br $next)))
+//     (i32.const 0))
+static const std::vector<uint8_t> streamCopyWasm = {
+    0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, 0x01, 0x0d, 0x03, 0x60,
+    0x00, 0x01, 0x7e, 0x60, 0x01, 0x7e, 0x00, 0x60, 0x00, 0x01, 0x7f, 0x02,
+    0x57, 0x03, 0x10, 0x65, 0x78, 0x74, 0x69, 0x73, 0x6d, 0x3a, 0x68, 0x6f,
+    0x73, 0x74, 0x2f, 0x75, 0x73, 0x65, 0x72, 0x0b, 0x73, 0x74, 0x72, 0x65,
+    0x61, 0x6d, 0x5f, 0x72, 0x65, 0x61, 0x64, 0x00, 0x00, 0x10, 0x65, 0x78,
+    0x74, 0x69, 0x73, 0x6d, 0x3a, 0x68, 0x6f, 0x73, 0x74, 0x2f, 0x75, 0x73,
+    0x65, 0x72, 0x0c, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x5f, 0x77, 0x72,
+    0x69, 0x74, 0x65, 0x00, 0x01, 0x0f, 0x65, 0x78, 0x74, 0x69, 0x73, 0x6d,
+    0x3a, 0x68, 0x6f, 0x73, 0x74, 0x2f, 0x65, 0x6e, 0x76, 0x04, 0x66, 0x72,
+    0x65, 0x65, 0x00, 0x01, 0x03, 0x02, 0x01, 0x02, 0x07, 0x08, 0x01, 0x04,
+    0x63, 0x6f, 0x70, 0x79, 0x00, 0x03, 0x0a, 0x1f, 0x01, 0x1d, 0x01, 0x01,
+    0x7e, 0x02, 0x40, 0x03, 0x40, 0x10, 0x00, 0x22, 0x00, 0x50, 0x0d, 0x01,
+    0x20, 0x00, 0x10, 0x01, 0x20, 0x00, 0x10, 0x02, 0x0c, 0x00, 0x0b, 0x0b,
+    0x41, 0x00, 0x0b};
+
+TEST(Plugin, CallStream) {
+  Plugin plugin(streamCopyWasm, false, streamFunctions());
+  std::string data(1 << 20, '\0');
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = static_cast<char>(i * 7);
+  }
+  std::istringstream in(data);
+  std::ostringstream out;
+  IstreamSource source(in);
+  OstreamSink sink(out);
+  plugin.callStream("copy", source, sink, 4096);
+  ASSERT_EQ(out.str(), data);
+
+  // Source errors end the input and are thrown once the call returns
+  struct FailingSource : StreamSource {
+    size_t read(uint8_t *buf, size_t len) override {
+      throw Error("source failed");
+    }
+  } failing;
+  try {
+    plugin.callStream("copy", failing, sink);
+    FAIL() << "expected an error";
+  } catch (const Error &e) {
+    ASSERT_STREQ(e.what(), "source failed");
+  }
+}
+
+TEST(CompiledPlugin, Instantiate) {
+  CompiledPlugin compiled(Manifest::wasmPath(code));
+
+  Plugin a = compiled.instantiate();
+  Plugin b(compiled);
+  ASSERT_TRUE(a.call("count_vowels", "this is a test").string().find(
+                  "\"count\":4") != std::string::npos);
+  ASSERT_TRUE(b.call("count_vowels", "aaa").string().find("\"count\":3") !=
+              std::string::npos);
+}
+
+TEST(CompiledPlugin, InstantiateFromThreads) {
+  auto wasm = read("../wasm/code-functions.wasm");
+  auto t = std::vector<ValType>{ValType::ExtismValType_I64};
+  Function hello_world =
+      Function("hello_world", t, t, [](CurrentPlugin plugin, void *user_data) {
+        plugin.output(std::string("testing123"));
+      });
+  CompiledPlugin compiled(wasm, true, {hello_world});
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; i++) {
+    threads.push_back(std::thread([&compiled]() {
+      Plugin plugin = compiled.instantiate();
+      ASSERT_EQ(plugin.call("count_vowels", "aaa").string(), "testing123");
+    }));
+  }
+
+  for (auto &th : threads) {
+    th.join();
+  }
+}
+
 void callThread(Plugin *plugin) {
   auto buf = plugin->call("count_vowels", "aaa").string();
   ASSERT_EQ(buf.size(), 10);
@@ -108,6 +1059,416 @@ TEST(Plugin, MultipleThreads) {
   }
 }
 
+TEST(PluginPool, Acquire) {
+  PluginPool pool(Manifest::wasmPath(code), false, {}, 2);
+  ASSERT_EQ(pool.size(), 0);
+
+  {
+    auto a = pool.acquire();
+    auto b = pool.tryAcquire();
+    ASSERT_TRUE(b.has_value());
+    ASSERT_FALSE(pool.tryAcquire().has_value());
+    ASSERT_TRUE(a.call("count_vowels", "aaa").string().find("\"count\":3") !=
+                std::string::npos);
+  }
+
+  ASSERT_EQ(pool.size(), 2);
+  ASSERT_EQ(pool.idle(), 2);
+  pool.shrink(1);
+  ASSERT_EQ(pool.size(), 1);
+}
+
+TEST(PluginPool, MultipleThreads) {
+  auto t = std::vector<ValType>{ValType::ExtismValType_I64};
+  Function hello_world =
+      Function("hello_world", t, t, [](CurrentPlugin plugin, void *user_data) {
+        plugin.output(std::string("testing123"));
+      });
+  PluginPool pool(Manifest::wasmPath("../wasm/code-functions.wasm"), true,
+                  {hello_world}, 2);
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; i++) {
+    threads.push_back(std::thread([&pool]() {
+      for (int j = 0; j < 10; j++) {
+        auto plugin = pool.acquire();
+        ASSERT_EQ(plugin.call("count_vowels", "aaa").string(), "testing123");
+      }
+    }));
+  }
+
+  for (auto &th : threads) {
+    th.join();
+  }
+  ASSERT_LE(pool.size(), 2);
+}
+
+TEST(PluginPool, WarmUp) {
+  // Each call to `globals` counts up a global
+  const auto manifest = Manifest::wasmPath("../wasm/globals.wasm");
+  Plugin fresh(manifest, true);
+  std::vector<std::string> counts;
+  for (int i = 0; i < 3; i++) {
+    counts.emplace_back(fresh.call("globals").string());
+  }
+  ASSERT_NE(counts[0], counts[1]);
+
+  PluginPool pool(manifest, true, {}, 2);
+  std::atomic<int> warmed{0};
+  pool.setWarmUp([&warmed](Plugin &plugin) {
+    plugin.call("globals");
+    warmed++;
+  });
+  pool.prewarm(2);
+  ASSERT_EQ(pool.idle(), 2);
+  ASSERT_EQ(warmed, 2);
+  pool.prewarm(2);
+  ASSERT_EQ(warmed, 2);
+
+  {
+    auto a = pool.acquire();
+    auto b = pool.acquire();
+    ASSERT_EQ(a.call("globals").string(), counts[1]);
+    ASSERT_EQ(b.call("globals").string(), counts[1]);
+  }
+  // The state survives being returned to the pool
+  ASSERT_EQ(pool.acquire().call("globals").string(), counts[2]);
+  ASSERT_EQ(warmed, 2);
+
+  PluginPool failing(manifest, true, {}, 1);
+  failing.setWarmUp([](Plugin &) { throw Error("warm-up failed"); });
+  ASSERT_THROW(failing.acquire(), Error);
+  ASSERT_EQ(failing.size(), 0);
+  failing.setWarmUp(nullptr);
+  ASSERT_NO_THROW(failing.acquire());
+}
+
+TEST(Plugin, CallOwned) {
+  Plugin plugin(read(code.c_str()));
+
+  OwnedBuffer a = plugin.callOwned("count_vowels", "aaa");
+  OwnedBuffer b = plugin.callOwned("count_vowels", "this is a test");
+  ASSERT_TRUE(a.string().find("\"count\":3") != std::string::npos);
+  ASSERT_TRUE(b.string().find("\"count\":4") != std::string::npos);
+
+  OwnedBuffer c = std::move(a);
+  ASSERT_EQ(a.length(), 0);
+  ASSERT_TRUE(c.string().find("\"count\":3") != std::string::npos);
+}
+
+TEST(Plugin, CallInto) {
+  Plugin plugin(read(code.c_str()));
+
+  uint8_t small[4];
+  size_t n = plugin.callInto("count_vowels", "aaa", small, sizeof(small));
+  ASSERT_GT(n, sizeof(small));
+
+  std::vector<uint8_t> out(n);
+  ASSERT_EQ(plugin.callInto("count_vowels", "aaa", out.data(), out.size()), n);
+  ASSERT_TRUE(std::string(out.begin(), out.end()).find("\"count\":3") !=
+              std::string::npos);
+
+  std::vector<uint8_t> reused;
+  plugin.callInto("count_vowels", "a", reused);
+  ASSERT_TRUE(std::string(reused.begin(), reused.end())
+                  .find("\"count\":1") != std::string::npos);
+}
+
+#ifdef EXTISM_CPP_CHECK_BUFFERS
+TEST(Plugin, StaleBuffer) {
+  Plugin plugin(read(code.c_str()));
+
+  Buffer buf = plugin.call("count_vowels", "aaa");
+  ASSERT_TRUE(buf.valid());
+  plugin.reset();
+  ASSERT_FALSE(buf.valid());
+  ASSERT_THROW(buf.string(), Error);
+}
+#endif
+
+TEST(Plugin, CallBatch) {
+  Plugin plugin(read(code.c_str()));
+
+  std::vector<std::string_view> inputs = {"a", "", "aaa", "this is a test"};
+  auto result = plugin.callBatch("count_vowels", inputs, 2);
+  ASSERT_EQ(result.size(), 4);
+  ASSERT_TRUE(result.failures().empty());
+  ASSERT_TRUE(result[0].string().find("\"count\":1") != std::string::npos);
+  ASSERT_TRUE(result[2].string().find("\"count\":3") != std::string::npos);
+  ASSERT_TRUE(result[3].string().find("\"count\":4") != std::string::npos);
+  ASSERT_EQ(result.offsetTable().back(), result.data().size());
+
+  auto failed = plugin.callBatch("bad_function", inputs);
+  ASSERT_EQ(failed.size(), 4);
+  ASSERT_EQ(failed.failures().size(), 4);
+  ASSERT_FALSE(failed.ok(1));
+  ASSERT_EQ(failed[1].length, 0);
+}
+
+TEST(Plugin, CallAsync) {
+  Plugin plugin(Manifest::wasmPath(code));
+  Executor executor(2);
+
+  std::vector<CallFuture> futures;
+  for (int i = 0; i < 8; i++) {
+    futures.push_back(plugin.callAsync("count_vowels", "aaa", executor));
+  }
+  for (auto &f : futures) {
+    auto out = f.get();
+    std::string s(out.begin(), out.end());
+    ASSERT_TRUE(s.find("\"count\":3") != std::string::npos);
+  }
+
+  std::promise<std::string> done;
+  plugin.callAsync(
+      "count_vowels", {'a', 'b'},
+      [&done](std::vector<uint8_t> out, std::exception_ptr err) {
+        done.set_value(std::string(out.begin(), out.end()));
+      },
+      executor);
+  ASSERT_TRUE(done.get_future().get().find("\"count\":1") !=
+              std::string::npos);
+}
+
+TEST(Plugin, CallAsyncCancel) {
+  Plugin plugin(Manifest::wasmPath("../wasm/loop.wasm"));
+  Executor executor(1);
+
+  auto future = plugin.callAsync("loop_forever", "", executor);
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  ASSERT_TRUE(future.cancel());
+  ASSERT_THROW(future.get(), Error);
+}
+
+TEST(Plugin, CallDeadline) {
+  Plugin plugin(Manifest::wasmPath("../wasm/loop.wasm"));
+  const auto start = std::chrono::steady_clock::now();
+  ASSERT_THROW(plugin.call("loop_forever", "",
+                           start + std::chrono::milliseconds(50)),
+               TimeoutError);
+  ASSERT_GE(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds(50));
+  ASSERT_THROW(plugin.call("loop_forever", "", start), TimeoutError);
+
+  Plugin vowels(Manifest::wasmPath(code));
+  auto out = vowels.call("count_vowels", "aaa",
+                         std::chrono::steady_clock::now() +
+                             std::chrono::seconds(10));
+  ASSERT_NE(out.string().find("\"count\":3"), std::string::npos);
+  // time_point::max() means no deadline, it must not fire right away
+  auto never = vowels.call("count_vowels", "aaa", Deadline::max());
+  ASSERT_NE(never.string().find("\"count\":3"), std::string::npos);
+  try {
+    vowels.call("missing", "", std::chrono::steady_clock::now() +
+                                   std::chrono::seconds(10));
+    FAIL();
+  } catch (const TimeoutError &) {
+    FAIL();
+  } catch (const Error &) {
+  }
+}
+
+TEST(Plugin, CallDeadlineStress) {
+  CompiledPlugin compiled(Manifest::wasmPath("../wasm/loop.wasm"));
+  const size_t threads = 64;
+  const size_t calls = 10000;
+  std::atomic<size_t> timeouts{0};
+  std::vector<std::thread> workers;
+  for (size_t t = 0; t < threads; t++) {
+    workers.emplace_back([&, t]() {
+      Plugin plugin = compiled.instantiate();
+      for (size_t i = t; i < calls; i += threads) {
+        try {
+          plugin.call("loop_forever", "",
+                      std::chrono::steady_clock::now() +
+                          std::chrono::milliseconds(1 + i % 3));
+        } catch (const TimeoutError &) {
+          timeouts += 1;
+        }
+      }
+    });
+  }
+  for (auto &w : workers) {
+    w.join();
+  }
+  ASSERT_EQ(timeouts, calls);
+  ASSERT_EQ(TimerWheel::shared().pending(), 0);
+}
+
+TEST(Plugin, FuelLimit) {
+  auto loop = Manifest::wasmPath("../wasm/loop.wasm");
+  loop.setFuelLimit(1000000);
+  Plugin plugin(loop);
+  ASSERT_EQ(plugin.fuelLimit(), 1000000);
+  ASSERT_THROW(plugin.call("loop_forever"), FuelExhausted);
+  // Each call gets the full limit again
+  ASSERT_THROW(plugin.call("loop_forever"), FuelExhausted);
+
+  Plugin vowels(read(code.c_str()), false, {}, 1000000);
+  ASSERT_NE(vowels.call("count_vowels", "aaa").string().find("\"count\":3"),
+            std::string::npos);
+  ASSERT_FALSE(Plugin(read(code.c_str())).fuelLimit().has_value());
+
+  ASSERT_THROW(CompiledPlugin compiled(loop), Error);
+}
+
+TEST(PluginPool, CallAsync) {
+  PluginPool pool(Manifest::wasmPath(code), false, {}, 4);
+
+  std::vector<CallFuture> futures;
+  for (int i = 0; i < 16; i++) {
+    futures.push_back(pool.callAsync("count_vowels", "aaaa"));
+  }
+  for (auto &f : futures) {
+    auto out = f.get();
+    std::string s(out.begin(), out.end());
+    ASSERT_TRUE(s.find("\"count\":4") != std::string::npos);
+  }
+}
+
+TEST(Pipeline, Stages) {
+  Plugin first(Manifest::wasmPath(code));
+  PluginPool middle(Manifest::wasmPath(code), false, {}, 4);
+  Plugin last(Manifest::wasmPath(code));
+  auto pipeline = Pipeline::Builder()
+                      .stage(first, "count_vowels")
+                      .stage(middle, "count_vowels", 2)
+                      .stage(last, "count_vowels")
+                      .queueSize(2)
+                      .build();
+
+  // Each stage counts the vowels in the JSON written by the one before
+  Plugin reference(Manifest::wasmPath(code));
+  std::vector<std::string> inputs;
+  std::vector<std::string> expected;
+  for (int i = 0; i < 32; i++) {
+    inputs.push_back(std::string(i, 'a') + "bcd");
+    std::string s = inputs.back();
+    for (int stage = 0; stage < 3; stage++) {
+      s = std::string(reference.call("count_vowels", s).string());
+    }
+    expected.push_back(s);
+  }
+
+  std::vector<CallFuture> futures;
+  for (const auto &input : inputs) {
+    futures.push_back(pipeline.submit(input));
+  }
+  std::atomic<int> called{0};
+  pipeline.submit(std::vector<uint8_t>{'a'},
+                  [&](std::vector<uint8_t> output, std::exception_ptr error) {
+                    if (error == nullptr && !output.empty()) {
+                      called++;
+                    }
+                  });
+  for (size_t i = 0; i < futures.size(); i++) {
+    auto out = futures[i].get();
+    ASSERT_EQ(std::string(out.begin(), out.end()), expected[i]);
+  }
+
+  auto failing = Pipeline::Builder()
+                     .stage(first, "count_vowels")
+                     .stage(last, "missing")
+                     .build();
+  ASSERT_THROW(failing.submit("aaa").get(), Error);
+
+  // Destroying the pipeline waits for the callback
+  pipeline = Pipeline::Builder().stage(middle, "count_vowels").build();
+  ASSERT_EQ(called, 1);
+  const auto stats = failing.stats();
+  ASSERT_EQ(stats.size(), 2);
+  ASSERT_EQ(stats[0].calls, 1);
+  ASSERT_EQ(stats[1].errors, 1);
+  ASSERT_EQ(stats[1].func, "missing");
+}
+
+TEST(Pipeline, Build) {
+  ASSERT_THROW(Pipeline::Builder().build(), Error);
+  Plugin plugin(Manifest::wasmPath(code));
+  ASSERT_THROW(Pipeline::Builder()
+                   .stage(plugin, "count_vowels")
+                   .stage(plugin, "count_vowels")
+                   .build(),
+               Error);
+}
+
+TEST(PluginHandle, ReloadUnderLoad) {
+  const auto manifest = Manifest::wasmPath(code);
+  PluginHandle handle(manifest, false, {}, 4);
+  const auto expected =
+      handle.call("count_vowels", "this is a test").release();
+
+  // A call checked out before a reload finishes on its version
+  auto old = handle.acquire();
+  ASSERT_EQ(handle.reload(manifest), 2);
+  ASSERT_EQ(handle.version(), 2);
+  ASSERT_EQ(old.call("count_vowels", "this is a test").vector(), expected);
+
+  std::atomic<bool> done{false};
+  std::atomic<uint64_t> calls{0};
+  std::atomic<uint64_t> failures{0};
+  std::atomic<int64_t> slowest{0};
+  std::vector<std::thread> callers;
+  for (int t = 0; t < 4; t++) {
+    callers.emplace_back([&]() {
+      uint64_t lastVersion = 0;
+      while (!done) {
+        const auto version = handle.version();
+        const auto start = std::chrono::steady_clock::now();
+        try {
+          auto out = handle.call("count_vowels", "this is a test");
+          if (std::vector<uint8_t>(out.data(), out.data() + out.length()) !=
+                  expected ||
+              version < lastVersion) {
+            failures++;
+          }
+        } catch (const Error &) {
+          failures++;
+        }
+        const int64_t elapsed =
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+        int64_t prev = slowest;
+        while (elapsed > prev && !slowest.compare_exchange_weak(prev, elapsed))
+          ;
+        lastVersion = version;
+        calls++;
+      }
+    });
+  }
+
+  // Every reload window sees calls complete
+  const int reloads = 20;
+  for (int i = 0; i < reloads; i++) {
+    const auto before = calls.load();
+    handle.reload(manifest);
+    while (calls.load() < before + 8) {
+      std::this_thread::yield();
+    }
+  }
+  done = true;
+  for (auto &t : callers) {
+    t.join();
+  }
+
+  ASSERT_EQ(failures, 0);
+  ASSERT_EQ(handle.version(), 2 + reloads);
+  // Reloading compiles off the call path, a call only ever waits for an
+  // instance of its own version
+  ASSERT_LT(slowest, 1000000);
+}
+
+TEST(PluginHandle, FromPool) {
+  const auto manifest = Manifest::wasmPath(code);
+  PluginHandle handle(PluginPool(manifest, false, {}, 2));
+  // The handle doesn't know how the pool was created
+  ASSERT_THROW(handle.reload(manifest), Error);
+  ASSERT_EQ(handle.version(), 1);
+  ASSERT_EQ(handle.reload(PluginPool(manifest, false, {}, 2)), 2);
+  ASSERT_TRUE(handle.acquire()->functionExists("count_vowels"));
+}
+
 }; // namespace
 
 int main(int argc, char **argv) {